@@ -0,0 +1,112 @@
+#ifndef EMU_DISPATCH_CACHE_H
+#define EMU_DISPATCH_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "emu/typedef.h"
+#include "util/assert.h"
+
+namespace emu {
+
+// The hot instruction cache consulted by the dispatcher before the slow instruction cache, and probed inline by
+// translated code at indirect exits.
+//
+// The cache is set-associative. Each set is kept in most-recently-used order, so translated code only needs to compare
+// the first way, while the dispatcher searches the whole set and moves the entry it finds to the front. Blocks that
+// map to the same set therefore no longer evict each other until the set is full.
+//
+// Odd numbers are never valid pc, so 1 marks empty entries and translated code needs no separate check for them.
+class Dispatch_cache {
+public:
+    struct Entry {
+        reg_t pc;
+        std::byte* code;
+    };
+
+    static constexpr reg_t empty = 1;
+
+private:
+    std::unique_ptr<Entry[]> entries_;
+    int set_bits_;
+    int way_bits_;
+
+    // Only lookups by the dispatcher are counted. Hits within translated code never reach it.
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t conflicts_ = 0;
+
+    Entry* set_of(reg_t pc) const noexcept {
+        return &entries_[index(pc) << way_bits_];
+    }
+
+public:
+    // Both the total number of entries and the number of ways must be powers of two.
+    Dispatch_cache(size_t size, size_t ways);
+
+    int set_bits() const noexcept { return set_bits_; }
+    int way_bits() const noexcept { return way_bits_; }
+    const Entry* entries() const noexcept { return entries_.get(); }
+
+    // Index of the set for the pc. Instructions are at least 2-byte aligned, so the lowest bit is dropped. Higher bits
+    // are folded in, so code laid out at a multiple of the cache size apart does not collide. Code_generator emits the
+    // same computation for its inline probe, so the two must be kept in sync.
+    size_t index(reg_t pc) const noexcept {
+        return ((pc >> 1) ^ (pc >> (1 + set_bits_))) & ((size_t(1) << set_bits_) - 1);
+    }
+
+    // Return the code for the pc, or nullptr if it is not cached.
+    std::byte* lookup(reg_t pc) noexcept {
+        Entry* set = set_of(pc);
+        if (LIKELY(set[0].pc == pc)) {
+            hits_++;
+            return set[0].code;
+        }
+
+        size_t ways = size_t(1) << way_bits_;
+        for (size_t i = 1; i < ways; i++) {
+            if (set[i].pc != pc) continue;
+            Entry entry = set[i];
+            for (size_t j = i; j > 0; j--) set[j] = set[j - 1];
+            set[0] = entry;
+            hits_++;
+            return entry.code;
+        }
+
+        misses_++;
+        return nullptr;
+    }
+
+    // Make the code the most recently used entry for the pc, evicting the least recently used one if the set is full.
+    void insert(reg_t pc, std::byte* code) noexcept {
+        Entry* set = set_of(pc);
+        size_t last = (size_t(1) << way_bits_) - 1;
+        size_t i = 0;
+        while (i < last && set[i].pc != pc) i++;
+        if (set[i].pc != pc && set[i].pc != empty) conflicts_++;
+        for (; i > 0; i--) set[i] = set[i - 1];
+        set[0] = {pc, code};
+    }
+
+    void erase(reg_t pc) noexcept {
+        Entry* set = set_of(pc);
+        size_t ways = size_t(1) << way_bits_;
+        for (size_t i = 0; i < ways; i++) {
+            if (set[i].pc != pc) continue;
+            for (; i + 1 < ways; i++) set[i] = set[i + 1];
+            set[ways - 1].pc = empty;
+            return;
+        }
+    }
+
+    void clear() noexcept;
+
+    void print_statistics(const char* name) const;
+};
+
+static_assert(sizeof(Dispatch_cache::Entry) == 16);
+
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef EMU_EDGE_PROFILE_H
+#define EMU_EDGE_PROFILE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "emu/typedef.h"
+
+namespace emu {
+
+// Execution counts of control flow edges between guest basic blocks. They are collected by the lower tier and used to
+// form regions along the hot path.
+//
+// Counters live in a direct-mapped table indexed by a hash of the edge, without tags, so colliding edges share a
+// counter. Only the guest thread increments counters, and compilation threads may read them at any time. As the
+// profile only guides heuristics, neither collisions nor stale reads affect correctness.
+struct Edge_profile {
+    static constexpr int bits = 16;
+    static constexpr size_t size = size_t(1) << bits;
+
+    std::atomic<uint32_t> counts[size];
+
+    Edge_profile() noexcept {
+        for (auto& count: counts) count.store(0, std::memory_order_relaxed);
+    }
+
+    std::atomic<uint32_t>& counter(reg_t from, reg_t to) noexcept {
+        uint64_t key = ((from >> 1) * 0x9E3779B97F4A7C15) ^ (to >> 1);
+        return counts[(key * 0x9E3779B97F4A7C15) >> (64 - bits)];
+    }
+
+    void record(reg_t from, reg_t to) noexcept {
+        auto& count = counter(from, to);
+        count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+
+    uint32_t count(reg_t from, reg_t to) noexcept {
+        return counter(from, to).load(std::memory_order_relaxed);
+    }
+};
+
+}
+
+#endif
@@ -5,6 +5,8 @@
 #include <stdexcept>
 #include <tuple>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include "config.h"
 #include "emu/typedef.h"
@@ -26,6 +28,33 @@ reg_t guest_mmap_nofail(reg_t address, reg_t size, int prot, int flags, int fd,
 int guest_mprotect(reg_t address, reg_t size, int prot);
 int guest_munmap(reg_t address, reg_t size);
 
+// Translated code is kept coherent with guest memory at page granularity. Binary translators register each page they
+// translate code from. Such pages are write-protected if the guest can write to them, so a write from guest or
+// emulator code raises SIGSEGV and the page is reported as modified instead of relying on fence.i. mmap, mprotect and
+// munmap over registered pages report them as well. Binary translators poll for modified ranges before dispatching
+// and drop translations overlapping them.
+
+// Set when there are modified ranges to be retrieved by take_modified_code_ranges.
+extern volatile bool code_modified;
+
+// Register a page that translated code is generated from.
+void track_code_page(reg_t page);
+
+// Called from the SIGSEGV handler. If the address lies in a write-protected code page, the page is made writable
+// again and reported as modified, and true is returned so the faulting instruction can be restarted.
+bool handle_code_write_fault(reg_t address) noexcept;
+
+// Writes done by the kernel on behalf of the guest fail with EFAULT instead of raising SIGSEGV, so code pages within
+// the buffer must be made writable before such system calls.
+void prepare_kernel_write(reg_t address, reg_t size);
+
+// Report code pages in shared mappings as modified, as they could have been written through another mapping without
+// faulting. Used by fence.i.
+void invalidate_shared_code_pages();
+
+// Retrieve ranges reported as modified since the last call, as [start, end) pairs, and clear code_modified.
+std::vector<std::pair<reg_t, reg_t>> take_modified_code_ranges();
+
 template<typename T>
 inline T load_memory(reg_t address) {
     return util::safe_read<T>(translate_address(address));
@@ -0,0 +1,127 @@
+#ifndef EMU_PC_MAP_H
+#define EMU_PC_MAP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+#include "emu/typedef.h"
+
+namespace emu {
+
+// A hash map from guest pc to T, used as the "slow" instruction cache behind the direct-mapped hot cache. Entries are
+// stored inline in a single array with open addressing and linear probing, so a lookup is usually a single cache line
+// access with no allocation or pointer chasing.
+//
+// Odd numbers are never valid pc, so 1 marks empty slots. Erasure shifts following entries back instead of leaving
+// tombstones, so probe sequences stay short even when blocks are frequently invalidated. As entries are moved by both
+// insertion and erasure, pointers returned are only valid until the map is next modified.
+template<typename T>
+class Pc_map {
+private:
+    static constexpr reg_t empty_key = 1;
+
+    struct Slot {
+        reg_t key = empty_key;
+        T value {};
+    };
+
+    std::unique_ptr<Slot[]> slots_;
+    size_t mask_;
+    size_t size_ = 0;
+
+    size_t index_of(reg_t key) const noexcept {
+        // Fibonacci hashing. Instructions are at least 2-byte aligned, so the lowest bit carries no information.
+        return ((key >> 1) * 0x9E3779B97F4A7C15) >> 20 & mask_;
+    }
+
+    void grow() {
+        auto old_slots = std::move(slots_);
+        size_t old_capacity = mask_ + 1;
+        slots_ = std::make_unique<Slot[]>(old_capacity * 2);
+        mask_ = old_capacity * 2 - 1;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old_slots[i].key == empty_key) continue;
+            size_t index = index_of(old_slots[i].key);
+            while (slots_[index].key != empty_key) index = (index + 1) & mask_;
+            slots_[index].key = old_slots[i].key;
+            slots_[index].value = std::move(old_slots[i].value);
+        }
+    }
+
+public:
+    explicit Pc_map(size_t capacity = 1024): slots_{std::make_unique<Slot[]>(capacity)}, mask_{capacity - 1} {}
+
+    size_t size() const noexcept { return size_; }
+
+    // Return the value for the pc, or nullptr if there is none.
+    T* find(reg_t key) noexcept {
+        for (size_t index = index_of(key);; index = (index + 1) & mask_) {
+            if (slots_[index].key == key) return &slots_[index].value;
+            if (slots_[index].key == empty_key) return nullptr;
+        }
+    }
+
+    // Return the value for the pc, inserting a default-constructed one if there is none.
+    T& operator [](reg_t key) {
+        size_t index = index_of(key);
+        for (;; index = (index + 1) & mask_) {
+            if (slots_[index].key == key) return slots_[index].value;
+            if (slots_[index].key == empty_key) break;
+        }
+
+        // Keep the load factor at most 1/2.
+        if ((size_ + 1) * 2 > mask_ + 1) {
+            grow();
+            index = index_of(key);
+            while (slots_[index].key != empty_key) index = (index + 1) & mask_;
+        }
+
+        size_++;
+        slots_[index].key = key;
+        return slots_[index].value;
+    }
+
+    void erase(reg_t key) noexcept {
+        size_t index = index_of(key);
+        while (slots_[index].key != key) {
+            if (slots_[index].key == empty_key) return;
+            index = (index + 1) & mask_;
+        }
+        size_--;
+
+        // Move back entries that would otherwise become unreachable, i.e. those whose home slot is not cyclically
+        // within (hole, current].
+        size_t hole = index;
+        for (size_t next = (hole + 1) & mask_; slots_[next].key != empty_key; next = (next + 1) & mask_) {
+            size_t home = index_of(slots_[next].key);
+            if (((next - home) & mask_) < ((next - hole) & mask_)) continue;
+            slots_[hole].key = slots_[next].key;
+            slots_[hole].value = std::move(slots_[next].value);
+            hole = next;
+        }
+        slots_[hole].key = empty_key;
+        slots_[hole].value = T {};
+    }
+
+    void clear() noexcept {
+        for (size_t i = 0; i <= mask_; i++) {
+            slots_[i].key = empty_key;
+            slots_[i].value = T {};
+        }
+        size_ = 0;
+    }
+
+    // Call func with each pc and value. The map must not be modified during the iteration.
+    template<typename Func>
+    void for_each(Func func) {
+        for (size_t i = 0; i <= mask_; i++) {
+            if (slots_[i].key != empty_key) func(slots_[i].key, slots_[i].value);
+        }
+    }
+};
+
+}
+
+#endif
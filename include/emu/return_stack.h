@@ -0,0 +1,45 @@
+#ifndef EMU_RETURN_STACK_H
+#define EMU_RETURN_STACK_H
+
+#include <cstddef>
+
+#include "emu/typedef.h"
+
+namespace emu {
+
+// A shadow stack of guest return addresses maintained by translated code. A call records the return address together
+// with the host code to continue at, and a return looks it up. If the recorded return address matches the actual
+// target, translated code jumps to the host code directly instead of going through the dispatcher.
+//
+// Instead of keeping a separate top-of-stack pointer, entries are indexed by the guest stack pointer. The stack pointer
+// at a return is the same as at the corresponding call, so no extra state needs to be kept in sync, and unwinding that
+// skips returns (e.g. longjmp) does not disturb the entries of outer frames. As the guest address is always compared,
+// a stale or aliased entry only leads to the slow path being taken, so the stack never affects correctness.
+struct Return_stack {
+    static constexpr size_t size = 256;
+
+    // Mask to apply to the stack pointer to get the byte offset of the entry. The stack pointer is usually 16-byte
+    // aligned, and each entry is 16 bytes, so the stack pointer can be used without shifting.
+    static constexpr size_t mask = (size - 1) * 16;
+
+    struct Entry {
+        reg_t pc;
+        std::byte* code;
+    };
+
+    Entry entries[size];
+
+    Return_stack() noexcept { clear(); }
+
+    // Invalidate all entries. This must be called when the code they point to is freed. Odd numbers are never valid pc
+    // so they can never match.
+    void clear() noexcept {
+        for (auto& entry: entries) entry.pc = 1;
+    }
+};
+
+static_assert(sizeof(Return_stack::Entry) == 16);
+
+}
+
+#endif
@@ -37,7 +37,8 @@ extern reg_t heap_end;
 // A flag to determine whether to print instruction out when it is decoded.
 extern bool disassemble;
 
-// A flag to determine whether instret should be updated precisely in binary translated code.
+// A flag to determine whether instret should be updated precisely in code of the simple binary translator. Code of the
+// IR-based binary translator, and of the simple one serving as its lower tier, always keeps instret precise.
 extern bool no_instret;
 
 // Upper limit of number of blocks that can be inlined by IR DBT.
@@ -46,21 +47,43 @@ extern int inline_limit;
 // Threshold beyond which the IR DBT will start working
 extern int compile_threshold;
 
+// Number of threads compiling hot blocks in the background. If zero, blocks are compiled when they become hot.
+extern int compile_threads;
+
+// Whether blocks below the compile threshold are run by the simple binary translator instead of the interpreter.
+extern bool tiered;
+
 // A flag to determine whether to trace all system calls. If true then all guest system calls will be logged.
 extern bool strace;
 
 // A flag to determine whether correctness in case of segmentation fault should be dealt strictly.
 extern bool strict_exception;
 
+// Whether faults in translated code are recovered from using side tables and siglongjmp instead of unwinding.
+extern bool fault_tables;
+
 // A flag to determine whether PHI nodes should be introduced to the graph by load elimination.
 extern bool enable_phi;
 
+// Whether IR-translated code keeps some guest registers in host callee-saved registers across blocks.
+extern bool pin_registers;
+
+// Whether registers are allocated across all blocks of a region instead of spilling everything at block ends.
+extern bool global_regalloc;
+
 // Whether compilation performance counters should be enabled.
 extern bool monitor_performance;
 
 // Whether direct memory access or call to helper should be generated for guest memory access.
 extern bool no_direct_memory_access;
 
+// Size in bytes of the region each binary translator allocates its code from.
+extern size_t code_cache_limit;
+
+// Number of entries and associativity of the dispatch cache of each binary translator. Both are powers of two.
+extern size_t icache_size;
+extern size_t icache_ways;
+
 }
 
 // This is not really an error. However it shares some properties with an exception, as it needs to break out from
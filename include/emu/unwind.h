@@ -63,6 +63,8 @@ void _Unwind_SetGR(struct _Unwind_Context *context, int index, uint64_t new_valu
 
 uint64_t _Unwind_GetIP(struct _Unwind_Context *context);
 
+uint64_t _Unwind_GetIPInfo(struct _Unwind_Context *context, int *ip_before_insn);
+
 void _Unwind_SetIP(struct _Unwind_Context *context, uint64_t new_value);
 
 uint64_t _Unwind_GetLanguageSpecificData(struct _Unwind_Context *context);
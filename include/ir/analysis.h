@@ -30,15 +30,25 @@ public:
         enumerate_blocks();
     }
 
-private:
+    // List blocks in depth-first order, which places every block after its dominators. Removing edges can leave blocks
+    // before their new dominators, so this needs to be redone afterwards.
     void enumerate_blocks();
 
-public:
     const std::vector<Node*>& blocks() { return _blocks; }
 
     void update_keepalive();
     void simplify_graph();
 
+    // Insert an empty block on the edge of the control, which must not be a keepalive edge. The new block is returned.
+    Node* split_edge(Value control);
+
+    // Remove the control edge from its target, together with the corresponding operands of PHI nodes, and from exit if
+    // it is a keepalive edge. PHI nodes of a target left with a single predecessor are replaced by their operand.
+    void remove_edge(Value control);
+
+    // Remove an unreachable block and all edges leaving it.
+    void remove_block(Node* block);
+
     // Reorder basic blocks so that number of jumps emitted by backend is reduced. It relies on dominance calculation
     // to avoid keeping dominator before dominated blocks (which is simpler for code generator).
     void reorder(Dominance& dominance);
@@ -82,6 +92,150 @@ private:
 
 };
 
+// Natural loops, found from back edges, i.e. edges to a block dominating their source. Only the loop nesting depth of
+// each block is kept, which is what the scheduler needs to keep loop-invariant nodes out of loops.
+class Loop_analysis {
+private:
+    Block& _block_analysis;
+    Dominance& _dom;
+    std::unordered_map<Node*, size_t> _depth;
+
+public:
+    Loop_analysis(Block& block_analysis, Dominance& dom): _block_analysis{block_analysis}, _dom{dom} {
+        compute_depth();
+    }
+
+    size_t depth(Node* block) {
+        auto ptr = _depth.find(block);
+        return ptr == _depth.end() ? 0 : ptr->second;
+    }
+
+private:
+    void compute_depth();
+};
+
+// Global value numbering over the dominator tree. Pure nodes are not bound to blocks until they are scheduled, so
+// Local_value_numbering already numbers them across the whole graph, given equal operands. What remains are PHI nodes
+// created by load/store elimination: guest registers not modified in a loop get PHI nodes whose operands are all the
+// same value, and registers holding copies of each other get PHI nodes with identical operands. These are replaced by
+// the value or the equivalent PHI node, which in turn exposes constants and equal operands to value numbering.
+class Global_value_numbering {
+private:
+    Graph& _graph;
+    Block& _block_analysis;
+    Dominance& _dom;
+    bool _changed;
+
+public:
+    Global_value_numbering(Graph& graph, Block& block_analysis, Dominance& dom):
+        _graph{graph}, _block_analysis{block_analysis}, _dom{dom} {}
+
+private:
+    void process(Node* block);
+
+public:
+    void run();
+};
+
+// Store-to-load forwarding and dead store elimination on guest memory. Addresses are split into a base value and a
+// constant offset, so accesses from the same base, typically sp, either overlap at known offsets or not at all, while
+// accesses from different bases may alias. Loads are forwarded along the memory chain, also into blocks with a single
+// predecessor. Stores are only removed when overwritten later in the same block, as other paths may read them.
+class Memory_load_store_elimination {
+private:
+    Graph& _graph;
+    Block& _block_analysis;
+
+public:
+    Memory_load_store_elimination(Graph& graph, Block& block_analysis):
+        _graph{graph}, _block_analysis{block_analysis} {}
+
+private:
+    static std::pair<Value, int64_t> decompose(Value address);
+    Value forward(Node* load);
+
+public:
+    void eliminate_load();
+    void eliminate_store();
+};
+
+// Sparse conditional constant propagation. Values are assumed to be constant and blocks unreachable until shown
+// otherwise, so constants carried around loops are found, and branches on them only make their taken edge reachable.
+// Guest registers are followed from load_register to the store_register nodes reaching it along reachable edges, so
+// constants are propagated through registers even where load/store elimination did not create PHI nodes. Afterwards
+// constant values are replaced, branches with a single reachable edge become jmp and unreachable blocks are removed.
+class Constant_propagation {
+private:
+    // Lattice values, from top (no evidence yet) to bottom (not a constant).
+    struct Lattice {
+        enum Kind: uint8_t { top, constant, bottom } kind;
+        uint64_t value;
+    };
+
+    Graph& _graph;
+    Block& _block_analysis;
+
+    std::unordered_map<Value, Lattice> _lattice;
+    std::unordered_set<Node*> _reachable_blocks;
+    std::unordered_set<Value> _reachable_edges;
+
+    // Block containing each memory node, and all load_register nodes.
+    std::unordered_map<Node*, Node*> _memop_block;
+    std::vector<Node*> _loads;
+
+    std::vector<Node*> _worklist;
+
+public:
+    Constant_propagation(Graph& graph, Block& block_analysis): _graph{graph}, _block_analysis{block_analysis} {}
+
+private:
+    Lattice get(Value value);
+    void set(Value value, Lattice lattice);
+    void mark_edge(Value control);
+    void visit_block(Node* block);
+    Lattice evaluate_load(Node* node);
+    Lattice evaluate_pure(Node* node);
+    void evaluate(Node* node);
+    void transform();
+
+public:
+    void run();
+};
+
+// Decide where instret of the context is updated. The frontend adds the length of each basic block at its end. These
+// additions are instead accumulated along the control flow, and only done before helpers that need the context, when
+// leaving the graph, and when paths with different counts join. In particular a loop needs only one addition per
+// iteration on its hot path. Memory accesses record the count not yet added, from which instret is reconstructed should
+// they fault.
+class Instret_placement {
+private:
+    Graph& _graph;
+    Block& _block_analysis;
+
+    // Blocks in reverse postorder.
+    std::vector<Node*> _order;
+    std::unordered_map<Node*, size_t> _index;
+
+    // Number of instructions retired but not yet added to instret at the start and the end of each block.
+    std::unordered_map<Node*, int64_t> _pending_in;
+    std::unordered_map<Node*, int64_t> _pending_out;
+
+    // Blocks ending with if can add part of their pending count before branching, so the addition needed on a back edge
+    // does not require an extra block. This is the amount.
+    std::unordered_map<Node*, int64_t> _hoisted;
+
+public:
+    Instret_placement(Graph& graph, Block& block_analysis): _graph{graph}, _block_analysis{block_analysis} {}
+
+private:
+    void compute_order();
+    void insert_before(Node* node, int64_t count);
+    int64_t accumulate(Node* block, int64_t pending);
+
+public:
+    void run();
+};
+
 class Scheduler {
 private:
     Graph& _graph;
@@ -98,15 +252,20 @@ private:
 
     Node* _block;
 
+    // Block each node is scheduled to early, i.e. the earliest block where all its operands are available.
+    std::unordered_map<Node*, Node*> _early;
+    Loop_analysis _loops;
+
 public:
     Scheduler(Graph& graph, Block& block_analysis, Dominance& dominance):
-        _graph{graph}, _block_analysis{block_analysis}, _dominance{dominance} {
+        _graph{graph}, _block_analysis{block_analysis}, _dominance{dominance}, _loops{block_analysis, dominance} {
 
     }
 
 private:
     void schedule_node_early(Node* node);
     void schedule_node_late(Node* node);
+    Node* hoist(Node* node, Node* block);
 
     void schedule_block(Node* block);
 
@@ -149,10 +308,16 @@ private:
     // Used for walking through each block to get all memory related nodes.
     std::vector<Node*>* _oplist;
 
+    // Whether loads can be replaced by PHI nodes.
+    bool _enable_phi;
+
+    // Block given to preload and the loads added there.
+    Node* _preheader = nullptr;
+
 public:
-    Load_store_elimination(Graph& graph, Block& block_analysis, Dominance& dom, size_t regcount):
+    Load_store_elimination(Graph& graph, Block& block_analysis, Dominance& dom, size_t regcount, bool enable_phi):
         _graph{graph}, _block_analysis{block_analysis}, _dom{dom},
-        _memops(regcount), _value_stack(regcount, std::vector<Value>{{}}) {
+        _memops(regcount), _value_stack(regcount, std::vector<Value>{{}}), _enable_phi{enable_phi} {
 
         populate_memops();
     }
@@ -167,6 +332,11 @@ private:
     void rename_store(Node* block);
 
 public:
+    // Load all registers loaded anywhere in the graph at the end of the block, which should be a loop preheader. PHI
+    // nodes are only created when all predecessors have a value, and otherwise the loop would have none from its entry.
+    // Loads not used after eliminate_load are removed again.
+    void preload(Node* block);
+
     void eliminate_load();
     void eliminate_store();
 };
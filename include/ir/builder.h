@@ -53,13 +53,22 @@ public:
         return inst->value(0);
     }
 
-    std::tuple<Value, Value> load_memory(Value dep, Type type, Value address) {
-        auto inst = create(Opcode::load_memory, {Type::memory, type}, {dep, address});
+    std::tuple<Value, Value> load_memory(Value dep, Type type, Value address, uint64_t pc, uint32_t instret) {
+        auto inst = _graph.manage(new Memory_access(
+            pc, instret, Opcode::load_memory, {Type::memory, type}, {dep, address}
+        ));
         return {inst->value(0), inst->value(1)};
     }
 
-    Value store_memory(Value dep, Value address, Value value) {
-        return create(Opcode::store_memory, {Type::memory}, {dep, address, value})->value(0);
+    Value store_memory(Value dep, Value address, Value value, uint64_t pc, uint32_t instret) {
+        auto inst = _graph.manage(new Memory_access(
+            pc, instret, Opcode::store_memory, {Type::memory}, {dep, address, value}
+        ));
+        return inst->value(0);
+    }
+
+    Value add_instret(Value dep, uint64_t count) {
+        return create(Opcode::add_instret, {Type::memory}, {dep, constant(Type::i64, count)})->value(0);
     }
 
     Value arithmetic(uint16_t opcode, Value left, Value right) {
@@ -83,6 +83,16 @@ enum: uint16_t {
     // Input: Memory, Value[]. Output: Memory, Value(opt)
     call,
 
+    // Record the return address (and the code to continue at) in the shadow return stack when a call is made.
+    // Input: Memory, Value(stack pointer), Value(return address). Output: Memory.
+    push_return,
+
+    // Add the number of instructions retired to instret, which the backend keeps in a host register and writes back to
+    // the context when leaving translated code or calling helpers. Nothing else reads instret in translated code, so
+    // these nodes can be merged and moved around freely, as long as the sum along each path is unchanged.
+    // Input: Memory, Value(constant). Output: Memory.
+    add_instret,
+
     /** Pure opcodes **/
 
     // Input: None. Output: Value.
@@ -332,6 +342,23 @@ public:
     uint16_t regnum() const { return _regnum; }
 };
 
+// Guest memory accesses. The guest pc of the accessing instruction and the number of instructions retired but not yet
+// added to instret of the context are kept, so the guest state can be reconstructed should the access fault, instead
+// of being stored before every access.
+class Memory_access: public Node {
+private:
+    uint64_t _pc;
+    uint32_t _instret;
+
+public:
+    Memory_access(uint64_t pc, uint32_t instret, uint16_t opcode, Type_container&& type, Operand_container&& operands):
+        Node(opcode, std::move(type), std::move(operands)), _pc{pc}, _instret{instret} {}
+
+    uint64_t pc() const { return _pc; }
+    uint32_t instret() const { return _instret; }
+    void instret(uint32_t instret) { _instret = instret; }
+};
+
 // For all nodes that is paired with another node. This include block/jmp/if.
 class Paired: public Node {
 private:
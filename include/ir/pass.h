@@ -34,11 +34,14 @@ private:
     Graph& _graph;
     std::unordered_set<Node*, Hash, Equal_to> _set;
 
+public:
+    // Evaluation of constant expressions. Constants are kept sign-extended to 64 bits regardless of their type.
     static uint64_t sign_extend(Type type, uint64_t value);
     static uint64_t zero_extend(Type type, uint64_t value);
     static uint64_t cast(Type type, Type oldtype, bool sext, uint64_t value);
     static uint64_t binary(Type type, uint16_t opcode, uint64_t l, uint64_t r);
 
+private:
     Value new_constant(Type type, uint64_t const_value);
     void replace_with_constant(Value value, uint64_t const_value);
     void lvn(Node* node);
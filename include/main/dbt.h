@@ -3,41 +3,109 @@
 
 #include <cstdint>
 #include <cstddef>
+#include <map>
 #include <memory>
-#include <unordered_map>
+#include <vector>
 
+#include "emu/dispatch_cache.h"
+#include "emu/edge_profile.h"
+#include "emu/pc_map.h"
+#include "emu/return_stack.h"
 #include "emu/typedef.h"
+#include "main/eh_frame.h"
 #include "main/executor.h"
+#include "main/signal.h"
 #include "util/code_buffer.h"
 
 namespace riscv {
     struct Context;
 }
 
-namespace util {
-class Code_buffer;
-};
-
 struct Dbt_block;
 
-class Dbt_runtime final: public Executor {
+class Dbt_runtime final: public Executor, public Fault_recoverable {
 private:
-    // The following two fields are for hot direct-mapped instruction cache that contains recently executed code.
-    std::unique_ptr<emu::reg_t[]> icache_tag_;
-    std::unique_ptr<std::byte*[]> icache_;
+    // A translated block returns the address of the trampoline to patch, or nullptr if nothing needs to be patched.
+    using Compiled_function = std::byte*(*)(riscv::Context&);
+
+    // The hot instruction cache that contains recently executed code.
+    emu::Dispatch_cache icache_;
+
+    // All translated code is allocated from here. It must outlive inst_cache_.
+    util::Code_cache code_cache_;
+
+    // Unwind information covering the whole code cache. The personality routine finds the block with block_at.
+    Eh_frame eh_frame_;
 
     // The "slow" instruction cache that contains all code that are compiled previously.
-    std::unordered_map<emu::reg_t, std::unique_ptr<Dbt_block>> inst_cache_;
+    emu::Pc_map<std::unique_ptr<Dbt_block>> inst_cache_;
+
+    // Reverse index from guest pages to pcs of blocks translated from them.
+    std::map<emu::reg_t, std::vector<emu::reg_t>> page_blocks_;
+
+    // Pcs of blocks ordered by the address of their code, so the block containing a host address can be found.
+    std::map<std::byte*, emu::reg_t> code_blocks_;
+
+    // Patched trampolines and pcs of blocks they jump to, ordered so links out of a block can be found by its code.
+    std::map<std::byte*, emu::reg_t> links_;
+
+    // Trampoline of the previously executed block that should be patched to jump to the next block.
+    std::byte* code_ptr_to_patch_ = nullptr;
+
+    // Shadow stack used by translated code to predict returns.
+    emu::Return_stack return_stack_;
+
+    // If non-zero, the runtime serves as the lower tier of Ir_dbt. Each block then returns to the dispatcher once it
+    // has been executed this many times, so it can be promoted.
+    int promotion_threshold_;
+
+    // Where outcomes of conditional branches are counted for the upper tier, if not null.
+    emu::Edge_profile* profile_;
 
-    void compile(emu::reg_t);
+    std::byte* compile(emu::reg_t);
+    void patch_trampoline(emu::reg_t pc, Compiled_function func);
+
+    // Drop a block and all references to it, restoring trampolines that chain into it.
+    void remove_block(emu::reg_t pc);
+
+    // Free the oldest generation of the code cache and remove all blocks within.
+    void evict_generation();
+
+    // Remove all blocks overlapping guest code reported as modified.
+    void invalidate_code();
 
 public:
-    Dbt_runtime();
+    explicit Dbt_runtime(int promotion_threshold = 0, emu::Edge_profile* profile = nullptr);
     ~Dbt_runtime();
 
     void step(riscv::Context& context);
     virtual void flush_cache() override;
 
+    // The block whose code contains the host address, used when unwinding through translated code.
+    Dbt_block& block_at(std::byte* host_pc);
+
+    // Guest registers always live in the context, so only pc and instret need to be derived from the host pc.
+    virtual void restore_fault_state(std::byte* host_pc, const greg_t* registers) noexcept override;
+
+    // The following are used by Ir_dbt when this runtime serves as its lower tier. Ir_dbt polls for modified code
+    // itself and forwards the ranges with invalidate, so run does not poll.
+
+    // Execute translated code starting from the current pc, translating it first if necessary.
+    void run(riscv::Context& context);
+
+    // Whether the block at pc has been executed promotion_threshold_ times.
+    bool is_hot(emu::reg_t pc);
+
+    // Remove the block at pc after it is promoted. Trampolines chaining into it are restored, so callers return to the
+    // dispatcher and reach the promoted code through it.
+    void retire(emu::reg_t pc);
+
+    // Remove all blocks overlapping the guest range.
+    void invalidate(emu::reg_t start, emu::reg_t end);
+
+    // Forget the trampoline to patch, as execution continues in code of the other tier.
+    void cancel_patch() noexcept { code_ptr_to_patch_ = nullptr; }
+
     friend class Dbt_compiler;
 };
 
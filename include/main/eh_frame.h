@@ -0,0 +1,30 @@
+#ifndef MAIN_EH_FRAME_H
+#define MAIN_EH_FRAME_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <memory>
+
+// Unwind information registered with the unwinder for a whole code cache at once. All frames of translated code in the
+// cache must then be described by the same call frame instructions, and the personality routine has to locate the
+// block itself. This keeps the unwinder's list of registered objects at one entry per translator, instead of one per
+// block that is searched on every throw and has to be registered and deregistered as blocks come and go.
+class Eh_frame {
+private:
+    std::unique_ptr<uint8_t[]> data_;
+
+public:
+    // Describe [begin, begin + size) with the personality routine, LSDA and call frame instructions. The instructions
+    // apply to the whole range, so they should describe frames after their initial `push rbp`, as a frame is never
+    // unwound before that. The CIE already defines CFA as rsp + 8 with the return address below it.
+    Eh_frame(
+        std::byte* begin, size_t size, void* personality, void* lsda, std::initializer_list<uint8_t> instructions
+    );
+    Eh_frame(const Eh_frame&) = delete;
+    ~Eh_frame();
+
+    Eh_frame& operator =(const Eh_frame&) = delete;
+};
+
+#endif
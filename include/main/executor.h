@@ -4,6 +4,10 @@
 class Executor {
 public:
     virtual void flush_cache() = 0;
+
+    // Called after a system call reported code as modified, e.g. by mmap or munmap. Executors whose translated code
+    // does not return to the dispatcher after system calls must make sure the next indirect exit does.
+    virtual void code_modified() {}
 };
 
 #endif
@@ -15,6 +15,8 @@ class Interpreter: public Executor {
 private:
     std::unordered_map<emu::reg_t, riscv::Basic_block> inst_cache_;
 
+    void invalidate_code();
+
 public:
     Interpreter() noexcept;
     ~Interpreter();
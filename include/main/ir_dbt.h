@@ -1,12 +1,24 @@
 #ifndef MAIN_IR_DBT_H
 #define MAIN_IR_DBT_H
 
+#include <atomic>
+#include <condition_variable>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 
+#include "emu/dispatch_cache.h"
+#include "emu/edge_profile.h"
+#include "emu/pc_map.h"
+#include "emu/return_stack.h"
 #include "emu/typedef.h"
 #include "ir/node.h"
+#include "main/eh_frame.h"
 #include "main/executor.h"
+#include "main/signal.h"
 #include "util/code_buffer.h"
 
 namespace riscv {
@@ -14,32 +26,116 @@ struct Context;
 }
 
 struct Ir_block;
+struct Ir_compilation;
 
-class Ir_dbt final: public Executor {
+// An entry of the slow instruction cache. Profiling state and the entry point are kept inline, so blocks still being
+// counted need no allocation and a compiled block can be entered without touching Ir_block.
+struct Ir_entry {
+    // Entry point of the compiled code, or null if the block is not compiled yet.
+    std::byte* code = nullptr;
+
+    // Number of times the block is hit. If the number reaches compile_threshold, IR DBT will start to work.
+    int num_hit = 0;
+
+    // Whether the block is waiting for background compilation.
+    bool requested = false;
+
+    std::unique_ptr<Ir_block> block;
+};
+class Dbt_runtime;
+
+class Ir_dbt final: public Executor, public Fault_recoverable {
 private:
     using Compiled_function = std::byte*(*)(riscv::Context&);
 
-     // The following two fields are for hot direct-mapped instruction cache that contains recently executed code.
-    std::unique_ptr<emu::reg_t[]> icache_tag_;
-    std::unique_ptr<std::byte*[]> icache_;
+    // The hot instruction cache that contains recently executed code. Translated code probes it at indirect exits.
+    emu::Dispatch_cache icache_;
+
+    // All translated code is allocated from here. It must outlive inst_cache_.
+    util::Code_cache code_cache_;
+
+    // Unwind information covering the whole code cache.
+    Eh_frame eh_frame_;
 
     // The "slow" instruction cache that contains all code that are compiled previously.
-    std::unordered_map<emu::reg_t, std::unique_ptr<Ir_block>> inst_cache_;
+    emu::Pc_map<Ir_entry> inst_cache_;
+
+    // Shadow stack used by translated code to predict returns.
+    emu::Return_stack return_stack_;
 
     int64_t total_compilation_time = 0;
     size_t total_block_compiled = 0;
 
+    // Reverse index from guest pages to pcs of blocks translated from them.
+    std::map<emu::reg_t, std::vector<emu::reg_t>> page_blocks_;
+
+    // Patched trampolines and pcs of blocks they jump to, ordered so links out of a block can be found by its code.
+    std::map<std::byte*, emu::reg_t> links_;
+
+    // Pcs of blocks ordered by the address of their code, so the block containing a host address can be found.
+    std::map<std::byte*, emu::reg_t> code_blocks_;
+
     std::byte* _code_ptr_to_patch = nullptr;
-    bool _need_cache_flush = false;
+
+    // Execution counts of edges taken in the lower tier, used to guide region formation.
+    std::unique_ptr<emu::Edge_profile> profile_;
+
+    // Successors reached by less than this fraction of executions of a block are not included in its region.
+    static constexpr uint32_t cold_edge_ratio = 8;
+
+    // Lower tier that runs blocks below the compile threshold, if tiered execution is enabled.
+    std::unique_ptr<Dbt_runtime> tier1_;
+
+    // Background compilation. Hot blocks are requested and keep running in the lower tier, while workers compile the
+    // hottest requests first. Results are installed by the guest thread in step(). All but has_finished_ are protected
+    // by queue_mutex_.
+    std::vector<std::thread> workers_;
+    std::mutex queue_mutex_;
+    std::condition_variable queue_cv_;
+    std::unordered_map<emu::reg_t, int> requests_;
+    std::vector<std::unique_ptr<Ir_compilation>> finished_;
+    std::atomic<bool> has_finished_ {false};
+    bool stopping_ = false;
+
+    // Drop a block and all references to it, restoring trampolines that chain into it.
+    void remove_block(emu::reg_t pc);
+
+    // Free the oldest generation of the code cache and remove all blocks within.
+    void evict_generation();
+
+    // Remove all blocks overlapping guest code reported as modified.
+    void invalidate_code();
+
+    // Decode, optimise and allocate registers for the region starting at pc. This does not touch the runtime state and
+    // can run on any thread.
+    std::unique_ptr<Ir_compilation> build(emu::reg_t pc, bool snapshot);
+
+    // Find natural loops in the control flow graph reachable from the start of the compilation.
+    void find_loops(Ir_compilation& compilation);
+
+    // Generate code for the region and make it reachable. False is returned if the guest code has changed or a
+    // generation had to be evicted, in which case nothing is installed.
+    bool install(Ir_compilation& compilation);
+
+    void request(Ir_entry& entry, emu::reg_t pc);
+    void work();
+    void install_finished();
 
 public:
-    Ir_dbt() noexcept;
+    Ir_dbt();
     ~Ir_dbt();
     void step(riscv::Context& context);
-    ir::Graph decode(emu::reg_t pc);
+    ir::Graph decode(emu::reg_t pc, Ir_compilation& compilation);
     void compile(riscv::Context& context, emu::reg_t pc);
-    void patch_trampoline(Compiled_function func);
+    void patch_trampoline(emu::reg_t pc, Compiled_function func);
     virtual void flush_cache() override;
+    virtual void code_modified() override;
+    virtual void restore_fault_state(std::byte* host_pc, const greg_t* registers) noexcept override;
+
+    // Restore pc, instret and pinned guest registers of the context if the host address is a memory access in
+    // translated code, given the values of the pinned host registers in the order of pinned_registers. Used both when
+    // recovering from a fault and when unwinding through translated code. Elsewhere the context is already up to date.
+    void restore_guest_state(std::byte* host_pc, riscv::Context& context, const uint64_t* pinned_values) noexcept;
 };
 
 #endif
@@ -1,6 +1,10 @@
 #ifndef MAIN_SIGNAL_H
 #define MAIN_SIGNAL_H
 
+#include <sys/ucontext.h>
+
+#include <csetjmp>
+#include <cstddef>
 #include <stdexcept>
 
 struct Segv_exception: std::runtime_error {
@@ -8,6 +12,23 @@ struct Segv_exception: std::runtime_error {
     Segv_exception(int sig): std::runtime_error {"segmentation fault"}, sig {sig} {}
 };
 
+// A binary translator whose guest state at a fault in translated code can be restored from side tables, so the fault
+// can be recovered from without unwinding through translated code.
+class Fault_recoverable {
+public:
+    // Make the guest context precise for a fault at the host pc, given host registers at the fault. This is called from
+    // the signal handler while the guest thread is stopped in translated code, so it must neither allocate nor throw.
+    virtual void restore_fault_state(std::byte* host_pc, const greg_t* registers) noexcept = 0;
+};
+
+// Where the dispatcher loop resumes when a fault is recovered from. The value passed is the signal number.
+extern sigjmp_buf fault_recovery_point;
+
+// Faults within the range are recovered from by the owner if emu::state::fault_tables is set. Otherwise, and for faults
+// elsewhere, e.g. in helper functions, Segv_exception is thrown from the signal handler.
+void add_translated_code(std::byte* begin, size_t size, Fault_recoverable* owner);
+void remove_translated_code(Fault_recoverable* owner);
+
 void setup_fault_handler();
 
 #endif
@@ -21,6 +21,10 @@ struct Context {
 
     // The execution engine that is currently operating on this context.
     Executor *executor;
+
+    // Host stack pointer right after the prologue of the outermost frame of IR-translated code. Chained blocks reuse
+    // the frame, so this is where the unwinder finds its canonical frame address regardless of the block's stack size.
+    uint64_t host_sp;
 };
 
 class Instruction;
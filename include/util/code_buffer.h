@@ -2,44 +2,107 @@
 #define UTIL_CODE_BUFFER_H
 
 #include <cstddef>
-#include <vector>
+#include <utility>
 
 namespace util {
 
-namespace internal {
+class Code_buffer;
 
-void* code_allocate(size_t element_size, size_t element_alignment, size_t count);
-void code_deallocate(void* ptr, size_t element_size, size_t element_alignment, size_t count) noexcept;
+// A large contiguous executable region from which code buffers are bump-allocated. Blocks are never moved, as
+// translated code embeds absolute addresses, so space cannot be compacted. Instead the region is split into equally
+// sized generations which are filled in a round-robin manner. Allocation only happens in the current generation, and
+// when it is full the owner evicts all blocks in the next (i.e. oldest) generation and advances into it.
+class Code_cache {
+private:
+    std::byte* base_;
 
-}
+    // Size of the mapped region.
+    size_t limit_;
 
-template<typename T>
-struct Code_allocator {
-    typedef T value_type;
+    // Size of each generation.
+    size_t generation_size_;
 
-    Code_allocator() = default;
+    // Index of the generation currently allocated from.
+    size_t generation_ = 0;
 
-    // Allow rebind
-    template <class U> constexpr Code_allocator(const Code_allocator<U>&) noexcept {}
+    // Offset of the first unallocated byte.
+    size_t top_ = 0;
 
-    T* allocate(std::size_t count) {
-        return reinterpret_cast<T*>(internal::code_allocate(sizeof(T), alignof(T), count));
-    }
+    // Number of bytes occupied by code buffers which are still alive.
+    size_t live_ = 0;
 
-    void deallocate(T* ptr, std::size_t count) noexcept {
-        internal::code_deallocate(ptr, sizeof(T), alignof(T), count);
-    }
-};
+    // Highest number of live bytes ever reached.
+    size_t peak_ = 0;
+
+    // Number of generations evicted.
+    size_t evictions_ = 0;
+
+    size_t generation_begin() const noexcept { return generation_ * generation_size_; }
+
+public:
+    // Alignment of each code buffer.
+    static constexpr size_t alignment = 16;
+
+    static constexpr size_t generation_count = 8;
+
+    // Smallest limit accepted, so that a generation can hold a few blocks.
+    static constexpr size_t min_limit = 64 * 1024;
+
+    explicit Code_cache(size_t limit);
+    Code_cache(const Code_cache&) = delete;
+    ~Code_cache();
 
-template <class T, class U>
-bool operator==(const Code_allocator<T>&, const Code_allocator<U>&) { return true; }
+    Code_cache& operator =(const Code_cache&) = delete;
 
-template <class T, class U>
-bool operator!=(const Code_allocator<T>&, const Code_allocator<U>&) { return false; }
+    std::byte* base() const noexcept { return base_; }
+    size_t limit() const noexcept { return limit_; }
+    size_t live() const noexcept { return live_; }
+    size_t peak() const noexcept { return peak_; }
+
+    // Whether nothing is allocated from the current generation. If an allocation fails in an empty generation, the
+    // request can never be satisfied.
+    bool generation_empty() const noexcept { return top_ == generation_begin(); }
+
+    // Address range of the generation that will be reused by advance(). All code buffers within must be freed and all
+    // references to them removed before advancing.
+    std::pair<std::byte*, std::byte*> next_generation() const noexcept;
+
+    // Start allocating from the next generation.
+    void advance() noexcept;
+
+    // Print fill ratio and eviction count of the cache.
+    void print_statistics(const char* name) const;
+
+    friend Code_buffer;
+};
+
+// A growable buffer of machine code allocated from a Code_cache. Only the most recently allocated buffer of a cache
+// can grow. std::bad_alloc is thrown if the current generation of the cache is exhausted.
+class Code_buffer {
+private:
+    Code_cache& cache_;
+    std::byte* data_ = nullptr;
+    size_t size_ = 0;
 
-class Code_buffer: public std::vector<std::byte, Code_allocator<std::byte>> {
 public:
-    using vector::vector;
+    explicit Code_buffer(Code_cache& cache) noexcept: cache_{cache} {}
+    Code_buffer(const Code_buffer&) = delete;
+    ~Code_buffer();
+
+    Code_buffer& operator =(const Code_buffer&) = delete;
+
+    std::byte* data() noexcept { return data_; }
+    const std::byte* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    bool empty() const noexcept { return size_ == 0; }
+
+    // Make sure the buffer can grow to the specified size. For a new buffer, this also fixes its location.
+    void reserve(size_t size);
+    void resize(size_t size);
+    void push_back(std::byte value) {
+        resize(size_ + 1);
+        data_[size_ - 1] = value;
+    }
 };
 
 }
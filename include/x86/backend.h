@@ -1,12 +1,17 @@
 #ifndef X86_BACKEND_H
 #define X86_BACKEND_H
 
+#include "emu/dispatch_cache.h"
+#include "emu/return_stack.h"
+#include "emu/typedef.h"
 #include "ir/analysis.h"
 #include "ir/pass.h"
 #include "x86/encoder.h"
 #include "x86/instruction.h"
 
 #include <unordered_map>
+#include <unordered_set>
+#include <utility>
 
 namespace x86::backend {
 
@@ -16,14 +21,39 @@ enum: uint16_t {
     // (Value base, Value index, Value scale, Value displacement) -> Value
     address = ir::Opcode::target_start,
     lea,
+
+    // (Value, Value) -> i1
+    // Whether the bitwise and of the operands is zero or non-zero, i.e. x86 test. Emitted by users like compares.
+    test_zero,
+    test_nonzero,
+
+    // (Memory, Value address, Value operand) -> Memory
+    // Binary operation on memory in place, fused from a load, the operation on the loaded value and a store of the
+    // result to the same address. Faults are attributed to the load.
+    add_memory,
+    sub_memory,
+    xor_memory,
+    or_memory,
+    and_memory,
 };
 
 }
 
+// Context slots kept in host callee-saved registers throughout translated code, numbered as 8-byte slots like register
+// numbers. The first is instret (slot 65), which is always kept in rbx so counting retired instructions does not touch
+// memory. The others are sp, ra, s0 and a0, which typical code uses the most, and are only kept in registers when
+// emu::state::pin_registers is set. Their values in the context are only up to date outside translated code, around
+// helper calls and when a memory access faults.
+inline constexpr std::pair<uint16_t, Register> pinned_registers[] = {
+    {65, Register::rbx}, {2, Register::r12}, {1, Register::r13}, {8, Register::r14}, {10, Register::r15},
+};
+
 class Lowering {
 private:
     ir::Graph& _graph;
     ir::Value match_address(ir::Value value, bool required);
+    void match_test(ir::Node* node);
+    void match_memory_operation(ir::Node* store);
 public:
     Lowering(ir::Graph& graph): _graph{graph} {};
     void run();
@@ -34,6 +64,11 @@ protected:
     virtual void write_node_content(std::ostream& stream, ir::Node* node) override;
 };
 
+// Allocates registers in a single pass over the scheduled nodes. By default, blocks are allocated independently and
+// values live across blocks are spilled at the end of each block. With emu::state::global_regalloc, liveness is
+// computed over the region first and blocks are still walked one at a time, in the spirit of second-chance binpacking:
+// values stay in registers across blocks, the value used furthest away is spilled, and differing locations at the two
+// ends of a control edge are reconciled by moves. Live ranges are not split into intervals.
 class Register_allocator {
 public:
     ir::Graph& _graph;
@@ -67,11 +102,36 @@ public:
     // Tracks whether a register can be spilled, i.e. not pinned.
     std::array<bool, 16> _pinned {};
 
-public:
-    Register_allocator(ir::Graph& graph, ir::analysis::Block& block_analysis, ir::analysis::Scheduler& scheduler):
-        _graph{graph}, _block_analysis{block_analysis}, _scheduler{scheduler} {
+    // Address operands of LEA nodes, and values of them spilled without a stack slot, which will be recomputed from
+    // these operands at the next use instead.
+    std::unordered_map<ir::Value, ir::Node::Operand_container> _remat_address;
+    std::unordered_set<ir::Value> _rematerialized;
+
+    /* State of whole-region allocation, used when emu::state::global_regalloc is set. */
+
+    // Where a value is at a block boundary, and its spilled copy if any.
+    struct Location {
+        ir::Value actual;
+        ir::Value memory;
+    };
+
+    bool _global_regalloc;
+    ir::Node* _block = nullptr;
+
+    // Number of uses of each value within each block. Uses by PHI nodes count towards the predecessor.
+    std::unordered_map<ir::Node*, std::unordered_map<ir::Value, int>> _local_uses;
+    std::unordered_map<ir::Node*, std::unordered_set<ir::Value>> _live_in;
+    std::unordered_map<ir::Node*, std::unordered_set<ir::Value>> _live_out;
 
-    }
+    // Locations of live values at the start and the end of each allocated block.
+    std::unordered_map<ir::Node*, std::unordered_map<ir::Value, ir::Value>> _entry_state;
+    std::unordered_map<ir::Node*, std::unordered_map<ir::Value, Location>> _end_state;
+
+    // Moves needed on each control edge besides those of PHI nodes, as (destination, source) pairs.
+    std::unordered_map<ir::Value, std::vector<std::pair<Operand, Operand>>> _edge_moves;
+
+public:
+    Register_allocator(ir::Graph& graph, ir::analysis::Block& block_analysis, ir::analysis::Scheduler& scheduler);
 
 private:
     /* Internal methods handling register allocation and spilling. */
@@ -112,12 +172,50 @@ private:
     void emit_compare(ir::Value value);
     void emit_address(ir::Value);
 
+    // Operands that must stay live to recompute a LEA value. A spilled value is only rematerialized if they are all
+    // live, and they are kept live until the value dies.
+    std::vector<ir::Value> remat_operands(ir::Value value);
+    bool can_rematerialize(ir::Value value);
+    ir::Value rematerialize(ir::Value value);
+
+    // Assign stack slots again after allocation by coloring their interference graph, built from liveness over the
+    // whole region. Slots are otherwise only reused within a block, and values live across blocks keep theirs.
+    void color_stack_slots();
+
+    /* Whole-region allocation. */
+
+    // Number of uses of the value left in the current block, plus one if it is live out of the block.
+    int use_count(ir::Value value);
+
+    // Distance in nodes to the next use of the value in the current block. Values only used by later blocks are
+    // furthest away.
+    size_t next_use(ir::Value value);
+    Register choose_spill_register();
+
+    void compute_liveness();
+    void enter_block(ir::Node* block);
+    void leave_block(ir::Node* block);
+    void compute_edge_moves();
+
 public:
     int get_stack_size() { return _stack_size; }
     Operand get_allocation(ir::Value value);
+    const std::vector<std::pair<Operand, Operand>>& get_edge_moves(ir::Value control) { return _edge_moves[control]; }
     void allocate();
 };
 
+// Guest state at a memory access in translated code, restored should the access fault. Sites are recorded in the
+// order code is emitted, so they are sorted by host offset.
+struct Memory_access_site {
+    // Offset of the accessing instruction from the start of the code.
+    uint32_t host_offset;
+
+    // Number of instructions executed since the start of the guest basic block.
+    uint32_t instret;
+
+    emu::reg_t pc;
+};
+
 class Code_generator {
 private:
     ir::Graph& _graph;
@@ -126,14 +224,38 @@ private:
     backend::Register_allocator& _regalloc;
     x86::Encoder _encoder;
 
+    // The hot instruction cache of the runtime. It is probed inline when the next pc is not a constant.
+    const emu::Dispatch_cache& _icache;
+
+    // The shadow return stack of the runtime.
+    emu::Return_stack* _return_stack;
+
+    // Offsets of immediates that should be filled with the address of the return stub. Each push needs its own stub,
+    // as the stub is patched to jump to a particular return address.
+    std::vector<size_t> _return_stub_use;
+
+    std::vector<Memory_access_site> _memory_access_sites;
+
 public:
+    // Length of the prologue, which chained blocks and inline cache hits jump past. The prologue saves the callee-saved
+    // registers in use and loads instret, and with pinned registers the pinned guest registers as well.
+    static constexpr int default_prologue_size = 23;
+    static constexpr int pinned_prologue_size = 47;
+    static int prologue_size();
+
+    // Number of leading entries of pinned_registers in use.
+    static size_t pinned_register_count();
+
     Code_generator(
         util::Code_buffer& buffer,
         ir::Graph& graph,
         ir::analysis::Block& block_analysis,
         ir::analysis::Scheduler& scheduler,
-        Register_allocator& regalloc
-    ): _graph{graph}, _block_analysis{block_analysis}, _scheduler{scheduler}, _regalloc{regalloc}, _encoder{buffer} {}
+        Register_allocator& regalloc,
+        const emu::Dispatch_cache& icache,
+        emu::Return_stack* return_stack
+    ): _graph{graph}, _block_analysis{block_analysis}, _scheduler{scheduler}, _regalloc{regalloc}, _encoder{buffer},
+       _icache{icache}, _return_stack{return_stack} {}
 
     void emit(const Instruction& inst);
     void emit_move(ir::Type type, const Operand& dst, const Operand& src);
@@ -143,17 +265,34 @@ public:
     bool need_phi(ir::Value control);
     void emit_phi(ir::Value control);
 
+    // Emit moves as if they happened at once. Moves are given as (destination, source) pairs, and are consumed.
+    void emit_parallel_move(std::vector<std::pair<Operand, Operand>>& moves);
+
     void emit_binary(ir::Node* node, Opcode opcode);
+    void emit_memory_binary(ir::Node* node, Opcode opcode);
     void emit_unary(ir::Node* node, Opcode opcode);
     void emit_mul(ir::Node* node, Opcode opcode);
     void emit_div(ir::Node* node, Opcode opcode);
     Condition_code emit_compare(ir::Value value);
     Memory emit_address(ir::Type type, ir::Value value);
 
+    void record_memory_access(ir::Node* node);
     void visit(ir::Node* node);
+    void emit_indirect_exit();
+    void emit_push_return(ir::Node* node);
+
+    // Write pinned registers back to the context, or reload them from it.
+    void store_pinned_registers();
+    void load_pinned_registers();
+
+    // Tear down the frame set up by the prologue, except for the stack slots of register allocator.
+    void emit_epilogue();
+    void emit_trampoline(std::vector<size_t>& trampoline_loc);
 
 public:
     void run();
+
+    std::vector<Memory_access_site>& memory_access_sites() { return _memory_access_sites; }
 };
 
 }
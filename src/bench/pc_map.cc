@@ -0,0 +1,76 @@
+// Lookup throughput of emu::Pc_map compared with std::unordered_map, the structure it replaces as the slow instruction
+// cache. Build with `make pc_map_bench`.
+
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "emu/pc_map.h"
+
+namespace {
+
+struct Block {
+    std::byte* code;
+};
+
+// Executing blocks are scattered across the guest text, so lookups are done in random order.
+std::vector<emu::reg_t> make_pcs(size_t count, std::mt19937_64& rng) {
+    std::vector<emu::reg_t> pcs;
+    pcs.reserve(count);
+    emu::reg_t pc = 0x10000;
+    for (size_t i = 0; i < count; i++) {
+        pc += (rng() % 32 + 1) * 2;
+        pcs.push_back(pc);
+    }
+    return pcs;
+}
+
+template<typename Func>
+double measure(size_t lookups, Func func) {
+    auto start = std::chrono::steady_clock::now();
+    func();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / lookups;
+}
+
+void run(size_t count) {
+    constexpr size_t lookups = 10000000;
+    std::mt19937_64 rng {count};
+    std::vector<emu::reg_t> pcs = make_pcs(count, rng);
+    std::vector<emu::reg_t> order(lookups);
+    for (auto& pc: order) pc = pcs[rng() % count];
+
+    std::vector<std::unique_ptr<Block>> blocks;
+    for (size_t i = 0; i < count; i++) blocks.push_back(std::make_unique<Block>(Block{nullptr}));
+
+    std::unordered_map<emu::reg_t, Block*> unordered_map;
+    emu::Pc_map<Block*> pc_map;
+    for (size_t i = 0; i < count; i++) {
+        unordered_map[pcs[i]] = blocks[i].get();
+        pc_map[pcs[i]] = blocks[i].get();
+    }
+
+    // Sum the results so the lookups cannot be optimised away.
+    uintptr_t sum = 0;
+    double unordered_map_ns = measure(lookups, [&]() {
+        for (auto pc: order) sum += reinterpret_cast<uintptr_t>(unordered_map.find(pc)->second);
+    });
+    double pc_map_ns = measure(lookups, [&]() {
+        for (auto pc: order) sum += reinterpret_cast<uintptr_t>(*pc_map.find(pc));
+    });
+
+    std::printf(
+        "%8zu blocks: std::unordered_map %6.2f ns/lookup, Pc_map %6.2f ns/lookup (%zx)\n",
+        count, unordered_map_ns, pc_map_ns, sum & 0xF
+    );
+}
+
+}
+
+int main() {
+    for (size_t count: {1000, 100000, 1000000}) run(count);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#include "emu/dispatch_cache.h"
+#include "util/format.h"
+
+namespace emu {
+
+namespace {
+
+int log2_exact(size_t value) {
+    ASSERT(value != 0 && (value & (value - 1)) == 0);
+    int bits = 0;
+    while ((size_t(1) << bits) != value) bits++;
+    return bits;
+}
+
+}
+
+Dispatch_cache::Dispatch_cache(size_t size, size_t ways):
+    entries_{std::make_unique<Entry[]>(size)}, set_bits_{log2_exact(size / ways)}, way_bits_{log2_exact(ways)} {
+
+    ASSERT(ways <= size);
+    clear();
+}
+
+void Dispatch_cache::clear() noexcept {
+    size_t size = size_t(1) << (set_bits_ + way_bits_);
+    for (size_t i = 0; i < size; i++) entries_[i].pc = empty;
+}
+
+void Dispatch_cache::print_statistics(const char* name) const {
+    uint64_t lookups = hits_ + misses_;
+    util::log(
+        "{} dispatch cache: {} sets of {} ways, {} hits, {} misses ({}%), {} conflict evictions.\n",
+        name, size_t(1) << set_bits_, size_t(1) << way_bits_, hits_, misses_,
+        lookups ? misses_ * 100 / lookups : 0, conflicts_
+    );
+}
+
+}
@@ -1,4 +1,5 @@
 #include <cstring>
+#include <map>
 #include <sys/mman.h>
 
 #include "emu/mmu.h"
@@ -6,6 +7,79 @@
 
 namespace emu {
 
+namespace {
+
+// Guest mappings, keyed by start address. Protection is stored in host form, i.e. after PROT_EXEC is translated.
+struct Mapping {
+    reg_t end;
+    int prot;
+    bool shared;
+};
+
+std::map<reg_t, Mapping> mappings;
+
+// Pages with translated code, keyed by page address.
+struct Code_page {
+    // Protection the guest expects the page to have.
+    int prot;
+
+    // Whether PROT_WRITE is currently removed from the page.
+    bool write_protected;
+
+    // Pages in shared or unknown mappings may be modified through other mappings, which cannot be detected.
+    bool shared;
+};
+
+std::map<reg_t, Code_page> code_pages;
+
+// Modified ranges not yet retrieved. As ranges are added from the signal handler, a fixed-size array is used to avoid
+// allocation. If it overflows, everything is considered modified.
+constexpr size_t max_modified_ranges = 64;
+std::pair<reg_t, reg_t> modified_ranges[max_modified_ranges];
+size_t modified_range_count = 0;
+bool modified_range_overflow = false;
+
+void add_modified_range(reg_t start, reg_t end) noexcept {
+    if (modified_range_count == max_modified_ranges) {
+        modified_range_overflow = true;
+    } else {
+        modified_ranges[modified_range_count++] = {start, end};
+    }
+    code_modified = true;
+}
+
+// Make sure no mapping crosses the address.
+void split_mapping(reg_t address) {
+    auto iter = mappings.upper_bound(address);
+    if (iter == mappings.begin()) return;
+    --iter;
+    if (iter->first < address && address < iter->second.end) {
+        Mapping second = iter->second;
+        iter->second.end = address;
+        mappings.emplace(address, second);
+    }
+}
+
+// Report registered code pages within the range as modified and forget about them. This is called before the range is
+// unmapped or remapped, so protection of write-protected pages is restored while the pages are still there.
+void invalidate_code_range(reg_t start, reg_t end) {
+    auto begin = code_pages.lower_bound(start);
+    auto last = code_pages.lower_bound(end);
+    if (begin == last) return;
+
+    for (auto iter = begin; iter != last; ++iter) {
+        if (iter->second.write_protected) {
+            mprotect(translate_address(iter->first), page_size, iter->second.prot);
+        }
+    }
+    code_pages.erase(begin, last);
+    add_modified_range(start, end);
+}
+
+}
+
+volatile bool code_modified = false;
+
 // Establish a mapping for guest.
 reg_t guest_mmap(reg_t address, reg_t size, int prot, int flags, int fd, reg_t offset) {
 
@@ -15,7 +89,19 @@ reg_t guest_mmap(reg_t address, reg_t size, int prot, int flags, int fd, reg_t o
         prot |= PROT_READ;
     }
 
-    return reinterpret_cast<reg_t>(mmap(translate_address(address), size, prot, flags, fd, offset));
+    // A fixed mapping replaces whatever was there, including code.
+    reg_t end = (address + size + page_mask) &~ page_mask;
+    if (flags & MAP_FIXED) invalidate_code_range(address, end);
+
+    reg_t ret = reinterpret_cast<reg_t>(mmap(translate_address(address), size, prot, flags, fd, offset));
+    if (ret != static_cast<reg_t>(-1)) {
+        end = (ret + size + page_mask) &~ page_mask;
+        split_mapping(ret);
+        split_mapping(end);
+        mappings.erase(mappings.lower_bound(ret), mappings.lower_bound(end));
+        mappings.emplace(ret, Mapping { end, prot, (flags & MAP_SHARED) != 0 });
+    }
+    return ret;
 }
 
 reg_t guest_mmap_nofail(reg_t address, reg_t size, int prot, int flags, int fd, reg_t offset) {
@@ -32,11 +118,127 @@ int guest_mprotect(reg_t address, reg_t size, int prot) {
         prot |= PROT_READ;
     }
 
-    return mprotect(translate_address(address), size, prot);
+    // Code in pages that can no longer be read cannot be executed either.
+    reg_t end = (address + size + page_mask) &~ page_mask;
+    if (!(prot & PROT_READ)) invalidate_code_range(address, end);
+
+    int ret = mprotect(translate_address(address), size, prot);
+    if (ret != 0) return ret;
+
+    split_mapping(address);
+    split_mapping(end);
+    for (auto iter = mappings.lower_bound(address); iter != mappings.end() && iter->first < end; ++iter) {
+        iter->second.prot = prot;
+    }
+
+    // Keep remaining code pages write-protected, but remember the new protection to restore.
+    for (auto iter = code_pages.lower_bound(address); iter != code_pages.end() && iter->first < end; ++iter) {
+        iter->second.prot = prot;
+        iter->second.write_protected =
+            (prot & PROT_WRITE) && mprotect(translate_address(iter->first), page_size, prot &~ PROT_WRITE) == 0;
+    }
+
+    return ret;
 }
 
 int guest_munmap(reg_t address, reg_t size) {
-    return munmap(translate_address(address), size);
+    reg_t end = (address + size + page_mask) &~ page_mask;
+    invalidate_code_range(address, end);
+
+    int ret = munmap(translate_address(address), size);
+    if (ret == 0) {
+        split_mapping(address);
+        split_mapping(end);
+        mappings.erase(mappings.lower_bound(address), mappings.lower_bound(end));
+    }
+    return ret;
+}
+
+void track_code_page(reg_t page) {
+    if (code_pages.count(page)) return;
+
+    // Pages not mapped through guest_mmap are treated as shared, as we know nothing about them.
+    Code_page code_page { 0, false, true };
+    auto iter = mappings.upper_bound(page);
+    if (iter != mappings.begin()) --iter;
+    if (iter != mappings.end() && iter->first <= page && page < iter->second.end) {
+        code_page.prot = iter->second.prot;
+        code_page.shared = iter->second.shared;
+        if (code_page.prot & PROT_WRITE) {
+            code_page.write_protected =
+                mprotect(translate_address(page), page_size, code_page.prot &~ PROT_WRITE) == 0;
+            if (!code_page.write_protected) code_page.shared = true;
+        }
+    }
+
+    code_pages.emplace(page, code_page);
+}
+
+bool handle_code_write_fault(reg_t address) noexcept {
+    reg_t page = address &~ page_mask;
+    auto iter = code_pages.find(page);
+    if (iter == code_pages.end() || !iter->second.write_protected) return false;
+
+    // The entry cannot be erased here, as that would free memory. It is removed by take_modified_code_ranges.
+    if (mprotect(translate_address(page), page_size, iter->second.prot) != 0) return false;
+    iter->second.write_protected = false;
+    add_modified_range(page, page + page_size);
+    return true;
+}
+
+void prepare_kernel_write(reg_t address, reg_t size) {
+    reg_t start = address &~ page_mask;
+    reg_t end = (address + size + page_mask) &~ page_mask;
+    for (auto iter = code_pages.lower_bound(start); iter != code_pages.end() && iter->first < end;) {
+        if (iter->second.write_protected) {
+            mprotect(translate_address(iter->first), page_size, iter->second.prot);
+            add_modified_range(iter->first, iter->first + page_size);
+            iter = code_pages.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+void invalidate_shared_code_pages() {
+    for (auto iter = code_pages.begin(); iter != code_pages.end();) {
+        if (iter->second.shared) {
+            if (iter->second.write_protected) {
+                mprotect(translate_address(iter->first), page_size, iter->second.prot);
+            }
+            add_modified_range(iter->first, iter->first + page_size);
+            iter = code_pages.erase(iter);
+        } else {
+            ++iter;
+        }
+    }
+}
+
+std::vector<std::pair<reg_t, reg_t>> take_modified_code_ranges() {
+    std::vector<std::pair<reg_t, reg_t>> ret;
+    if (modified_range_overflow) {
+        ret.push_back({0, static_cast<reg_t>(-1)});
+    } else {
+        ret.assign(modified_ranges, modified_ranges + modified_range_count);
+    }
+
+    // Forget pages reported from the signal handler, so they are protected again when code is translated from them.
+    // Pages within the range that are still protected are only expected after an overflow.
+    for (auto& range: ret) {
+        auto begin = code_pages.lower_bound(range.first);
+        auto end = range.second == static_cast<reg_t>(-1) ? code_pages.end() : code_pages.lower_bound(range.second);
+        for (auto iter = begin; iter != end; ++iter) {
+            if (iter->second.write_protected) {
+                mprotect(translate_address(iter->first), page_size, iter->second.prot);
+            }
+        }
+        code_pages.erase(begin, end);
+    }
+
+    modified_range_count = 0;
+    modified_range_overflow = false;
+    code_modified = false;
+    return ret;
 }
 
 }
@@ -19,14 +19,30 @@ int inline_limit = 15;
 
 int compile_threshold = 0;
 
+int compile_threads = 0;
+
+bool tiered = false;
+
 bool strace = false;
 
 bool strict_exception = false;
 
+bool fault_tables = false;
+
 bool enable_phi = false;
 
+bool pin_registers = false;
+
+bool global_regalloc = false;
+
 bool monitor_performance = false;
 
 bool no_direct_memory_access = false;
 
+size_t code_cache_limit = 256 << 20;
+
+size_t icache_size = 4096;
+
+size_t icache_ways = 4;
+
 }
@@ -329,6 +329,7 @@ reg_t syscall(
         case riscv::abi::Syscall_number::getcwd: {
             char *buffer = reinterpret_cast<char*>(translate_address(arg0));
             size_t size = arg1;
+            prepare_kernel_write(arg0, size);
             sreg_t ret = getcwd(buffer, size) ? 0 : -static_cast<sreg_t>(riscv::abi::Errno::einval);
             if (state::strace) {
                 if (ret == 0) {
@@ -417,6 +418,7 @@ reg_t syscall(
             auto buffer = reinterpret_cast<char*>(translate_address(arg1));
 
             // Handle standard IO specially, since it is shared between emulator and guest program.
+            prepare_kernel_write(arg1, arg2);
             sreg_t ret = return_errno(read(arg0, buffer, arg2));
 
             if (state::strace) {
@@ -485,6 +487,7 @@ reg_t syscall(
                     ret = return_errno(-1);
                 }
             } else {
+                prepare_kernel_write(arg2, arg3);
                 ret = return_errno(readlinkat(dirfd, translate_path(pathname), buffer, arg3));
             }
 
@@ -573,6 +576,7 @@ reg_t syscall(
                 );
 
             } else {
+                prepare_kernel_write(arg0, sizeof(struct utsname));
                 ret = return_errno(uname(reinterpret_cast<struct utsname*>(translate_address(arg0))));
             }
 
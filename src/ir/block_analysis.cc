@@ -42,6 +42,7 @@ Value Block::get_tail_jmp_pc(Value control, uint16_t pc_regnum) {
 }
 
 void Block::enumerate_blocks() {
+    _blocks.clear();
     std::vector<Node*> stack { *_graph.entry()->value(0).references().begin() };
     while (!stack.empty()) {
         auto node = stack.back();
@@ -179,6 +180,66 @@ void Block::simplify_graph() {
     }
 }
 
+Node* Block::split_edge(Value control) {
+    ASSERT(control.references().size() == 1);
+    auto target = *control.references().begin();
+    ASSERT(target->opcode() == Opcode::block);
+
+    auto block = static_cast<Paired*>(_graph.manage(new Paired(Opcode::block, {Type::memory}, {})));
+    auto jmp = static_cast<Paired*>(_graph.manage(new Paired(Opcode::jmp, {Type::control}, {block->value(0)})));
+    block->mate(jmp);
+    jmp->mate(block);
+    target->operand_update(control, jmp->value(0));
+    block->operand_add(control);
+
+    // Place the new block right after the source, so it is still visited after its dominator. A block on the edge from
+    // entry becomes the first block.
+    if (control.opcode() == Opcode::entry) {
+        _blocks.insert(_blocks.begin(), block);
+        return block;
+    }
+    auto source = static_cast<Paired*>(control.node())->mate();
+    _blocks.insert(std::find(_blocks.begin(), _blocks.end(), source) + 1, block);
+    return block;
+}
+
+void Block::remove_edge(Value control) {
+    std::vector<Node*> refs(control.references().begin(), control.references().end());
+    for (auto ref: refs) {
+        if (ref->opcode() == Opcode::exit) {
+            ref->operand_delete(control);
+            continue;
+        }
+
+        size_t index = ref->operand_find(control);
+        auto operands = ref->operands();
+        operands.erase(operands.begin() + index);
+        ref->operands(std::move(operands));
+
+        // Operands of PHI nodes are offset by the memory dependency.
+        std::vector<Node*> phis;
+        for (auto phi: ref->value(0).references()) {
+            if (phi->opcode() == Opcode::phi) phis.push_back(phi);
+        }
+        for (auto phi: phis) {
+            auto phi_operands = phi->operands();
+            phi_operands.erase(phi_operands.begin() + index + 1);
+            phi->operands(std::move(phi_operands));
+
+            if (ref->operand_count() == 1) {
+                replace_value(phi->value(0), phi->operand(1));
+                phi->operands({});
+            }
+        }
+    }
+}
+
+void Block::remove_block(Node* block) {
+    auto end = static_cast<Paired*>(block)->mate();
+    for (auto value: end->values()) remove_edge(value);
+    _blocks.erase(std::find(_blocks.begin(), _blocks.end(), block));
+}
+
 void Block::reorder(Dominance& dominance) {
 
     // A very simple algorithm that gives a heuristic penalty about a certain ordering of blocks.
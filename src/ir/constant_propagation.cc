@@ -0,0 +1,285 @@
+#include <algorithm>
+
+#include "ir/analysis.h"
+#include "ir/builder.h"
+#include "ir/pass.h"
+#include "ir/visit.h"
+
+namespace ir::analysis {
+
+namespace {
+
+using Lvn = pass::Local_value_numbering;
+
+}
+
+Constant_propagation::Lattice Constant_propagation::get(Value value) {
+    if (value.is_const()) return {Lattice::constant, value.const_value()};
+    auto ptr = _lattice.find(value);
+    if (ptr == _lattice.end()) return {Lattice::top, 0};
+    return ptr->second;
+}
+
+void Constant_propagation::set(Value value, Lattice lattice) {
+    auto old = get(value);
+
+    // Values only move down the lattice, which bounds the number of times each node is evaluated.
+    if (old.kind == Lattice::bottom || lattice.kind == Lattice::top) return;
+    if (old.kind == Lattice::constant) {
+        if (lattice.kind == Lattice::constant && lattice.value == old.value) return;
+        lattice.kind = Lattice::bottom;
+    }
+
+    _lattice[value] = lattice;
+    for (auto ref: value.references()) _worklist.push_back(ref);
+}
+
+void Constant_propagation::mark_edge(Value control) {
+    if (!_reachable_edges.insert(control).second) return;
+
+    for (auto target: control.references()) {
+        if (target->opcode() == Opcode::exit) continue;
+
+        if (_reachable_blocks.insert(target).second) {
+            visit_block(target);
+            continue;
+        }
+
+        // A new edge into a reachable block brings in new operands of PHI nodes and new stores reaching loads.
+        for (auto ref: target->value(0).references()) {
+            if (ref->opcode() == Opcode::phi) _worklist.push_back(ref);
+        }
+        _worklist.insert(_worklist.end(), _loads.begin(), _loads.end());
+    }
+}
+
+void Constant_propagation::visit_block(Node* block) {
+    for (auto ref: block->value(0).references()) {
+        if (ref->opcode() == Opcode::phi) _worklist.push_back(ref);
+    }
+
+    auto end = static_cast<Paired*>(block)->mate();
+    for (auto node = end->operand(0).node(); node != block; node = node->operand(0).node()) {
+        _worklist.push_back(node);
+    }
+    _worklist.push_back(end);
+}
+
+Constant_propagation::Lattice Constant_propagation::evaluate_load(Node* node) {
+    uint16_t regnum = static_cast<Register_access*>(node)->regnum();
+    Lattice result {Lattice::top, 0};
+    auto meet = [&](Lattice lattice) {
+        if (lattice.kind == Lattice::top || result.kind == Lattice::bottom) return;
+        if (result.kind == Lattice::top) {
+            result = lattice;
+        } else if (lattice.kind == Lattice::bottom || lattice.value != result.value) {
+            result.kind = Lattice::bottom;
+        }
+    };
+
+    // Walk the memory chain backwards, following reachable edges into predecessors when reaching the start of a block.
+    std::unordered_set<Node*> visited;
+    std::vector<Node*> stack { node->operand(0).node() };
+    while (!stack.empty() && result.kind != Lattice::bottom) {
+        auto memop = stack.back();
+        stack.pop_back();
+
+        while (true) {
+            if (memop->opcode() == Opcode::store_register) {
+                if (static_cast<Register_access*>(memop)->regnum() == regnum) {
+                    meet(get(memop->operand(1)));
+                    break;
+                }
+            } else if (memop->opcode() == Opcode::call && static_cast<Call*>(memop)->need_context()) {
+                return {Lattice::bottom, 0};
+            } else if (memop->opcode() == Opcode::block) {
+                if (!visited.insert(memop).second) break;
+                for (auto operand: memop->operands()) {
+
+                    // The value held on entry to the graph is not known.
+                    if (operand.opcode() == Opcode::entry) return {Lattice::bottom, 0};
+                    if (_reachable_edges.count(operand)) stack.push_back(operand.node()->operand(0).node());
+                }
+                break;
+            }
+            memop = memop->operand(0).node();
+        }
+    }
+
+    return result;
+}
+
+Constant_propagation::Lattice Constant_propagation::evaluate_pure(Node* node) {
+    auto opcode = node->opcode();
+
+    if (opcode == Opcode::mux) {
+        auto cond = get(node->operand(0));
+        if (cond.kind == Lattice::constant) return get(node->operand(cond.value ? 1 : 2));
+        if (cond.kind == Lattice::top) return cond;
+        auto x = get(node->operand(1));
+        auto y = get(node->operand(2));
+        if (x.kind == Lattice::constant && y.kind == Lattice::constant && x.value == y.value) return x;
+        if (x.kind == Lattice::bottom || y.kind == Lattice::bottom) return {Lattice::bottom, 0};
+
+        // Wait for both arms to be known before deciding. Two different constants make the result unknown.
+        if (x.kind == Lattice::top || y.kind == Lattice::top) return {Lattice::top, 0};
+        return {Lattice::bottom, 0};
+    }
+
+    if (opcode != Opcode::cast && opcode != Opcode::neg && opcode != Opcode::i_not && !is_binary_opcode(opcode)) {
+        return {Lattice::bottom, 0};
+    }
+
+    for (auto operand: node->operands()) {
+        auto lattice = get(operand);
+        if (lattice.kind != Lattice::constant) return lattice;
+    }
+
+    auto type = node->value(0).type();
+    auto x = node->operand(0);
+    uint64_t value;
+    switch (opcode) {
+        case Opcode::cast:
+            value = Lvn::cast(type, x.type(), static_cast<Cast*>(node)->sign_extend(), get(x).value);
+            break;
+        case Opcode::neg: value = Lvn::sign_extend(type, -get(x).value); break;
+        case Opcode::i_not: value = ~get(x).value; break;
+        default: value = Lvn::binary(x.type(), opcode, get(x).value, get(node->operand(1)).value); break;
+    }
+    return {Lattice::constant, value};
+}
+
+void Constant_propagation::evaluate(Node* node) {
+    switch (node->opcode()) {
+        case Opcode::phi: {
+            auto block = node->operand(0).node();
+            Lattice result {Lattice::top, 0};
+            for (size_t i = 0; i < block->operand_count(); i++) {
+                if (!_reachable_edges.count(block->operand(i))) continue;
+                auto lattice = get(node->operand(i + 1));
+                if (lattice.kind == Lattice::top) continue;
+                if (result.kind == Lattice::top) {
+                    result = lattice;
+                } else if (lattice.kind == Lattice::bottom || lattice.value != result.value) {
+                    result.kind = Lattice::bottom;
+                    break;
+                }
+            }
+            set(node->value(0), result);
+            break;
+        }
+        case Opcode::load_register:
+            if (_reachable_blocks.count(_memop_block[node])) set(node->value(1), evaluate_load(node));
+            break;
+        case Opcode::store_register:
+            // Loads of the register may see a new value.
+            for (auto load: _loads) {
+                if (static_cast<Register_access*>(load)->regnum() == static_cast<Register_access*>(node)->regnum()) {
+                    _worklist.push_back(load);
+                }
+            }
+            break;
+        case Opcode::load_memory:
+        case Opcode::call:
+            for (auto value: node->values()) {
+                if (value.type() != Type::memory) set(value, {Lattice::bottom, 0});
+            }
+            break;
+        case Opcode::i_if: {
+            if (!_reachable_blocks.count(static_cast<Paired*>(node)->mate())) break;
+            auto cond = get(node->operand(1));
+            if (cond.kind == Lattice::top) break;
+            if (cond.kind == Lattice::bottom || cond.value) mark_edge(node->value(0));
+            if (cond.kind == Lattice::bottom || !cond.value) mark_edge(node->value(1));
+            break;
+        }
+        case Opcode::jmp:
+            if (_reachable_blocks.count(static_cast<Paired*>(node)->mate())) mark_edge(node->value(0));
+            break;
+        default:
+            if (is_pure_opcode(node->opcode()) && node->opcode() != Opcode::constant) {
+                if (node->value_count() == 1) {
+                    set(node->value(0), evaluate_pure(node));
+                } else {
+                    for (auto value: node->values()) set(value, {Lattice::bottom, 0});
+                }
+            }
+            break;
+    }
+}
+
+void Constant_propagation::transform() {
+    Builder builder{_graph};
+
+    // Replace values found to be constant. Loads replaced are removed from the memory chain as well.
+    for (auto& [value, lattice]: _lattice) {
+        if (lattice.kind != Lattice::constant || value.references().empty()) continue;
+        replace_value(value, builder.constant(value.type(), lattice.value));
+
+        auto node = value.node();
+        if (node->opcode() == Opcode::load_register) {
+            replace_value(node->value(0), node->operand(0));
+            node->operands({});
+        } else if (node->opcode() == Opcode::phi) {
+            node->operands({});
+        }
+    }
+
+    // Branches with a single reachable edge become jumps.
+    std::vector<Node*> unreachable;
+    for (auto block: _block_analysis.blocks()) {
+        if (!_reachable_blocks.count(block)) {
+            unreachable.push_back(block);
+            continue;
+        }
+
+        auto end = static_cast<Paired*>(block)->mate();
+        if (end->opcode() != Opcode::i_if) continue;
+
+        bool reachable_true = _reachable_edges.count(end->value(0));
+        bool reachable_false = _reachable_edges.count(end->value(1));
+        if (reachable_true == reachable_false) continue;
+
+        _block_analysis.remove_edge(end->value(reachable_true ? 1 : 0));
+        auto jmp = static_cast<Paired*>(builder.jmp(end->operand(0)).node());
+        replace_value(end->value(reachable_true ? 0 : 1), jmp->value(0));
+        end->operands({});
+        static_cast<Paired*>(block)->mate(jmp);
+        jmp->mate(block);
+    }
+
+    for (auto block: unreachable) _block_analysis.remove_block(block);
+
+    // A block reached through a folded branch may now be dominated by a block listed after it.
+    _block_analysis.enumerate_blocks();
+
+    // Folded branches may leave loops without exits.
+    _block_analysis.update_keepalive();
+}
+
+void Constant_propagation::run() {
+    for (auto block: _block_analysis.blocks()) {
+        auto end = static_cast<Paired*>(block)->mate();
+        for (auto node = end->operand(0).node(); node != block; node = node->operand(0).node()) {
+            _memop_block[node] = block;
+            if (node->opcode() == Opcode::load_register) _loads.push_back(node);
+        }
+    }
+
+    // Pure nodes are otherwise only evaluated when their operands change, which never happens for constant operands.
+    visit_postorder(_graph, [this](Node* node) {
+        if (is_pure_opcode(node->opcode())) _worklist.push_back(node);
+    });
+    std::reverse(_worklist.begin(), _worklist.end());
+
+    mark_edge(_graph.entry()->value(0));
+    while (!_worklist.empty()) {
+        auto node = _worklist.back();
+        _worklist.pop_back();
+        evaluate(node);
+    }
+
+    transform();
+}
+
+}
@@ -304,4 +304,31 @@ Node* Dominance::least_common_dominator(Node* a, Node* b) {
     return a;
 }
 
+void Loop_analysis::compute_depth() {
+    for (auto header: _block_analysis.blocks()) {
+
+        // Blocks of all loops with this header, found by walking backwards from the sources of back edges.
+        std::unordered_set<Node*> body { header };
+        std::vector<Node*> stack;
+        for (auto operand: header->operands()) {
+            if (operand.opcode() == Opcode::entry) continue;
+            auto source = static_cast<Paired*>(operand.node())->mate();
+            if (_dom.least_common_dominator(header, source) == header) stack.push_back(source);
+        }
+        if (stack.empty()) continue;
+
+        while (!stack.empty()) {
+            auto block = stack.back();
+            stack.pop_back();
+            if (!body.insert(block).second) continue;
+            for (auto operand: block->operands()) {
+                if (operand.opcode() == Opcode::entry) continue;
+                stack.push_back(static_cast<Paired*>(operand.node())->mate());
+            }
+        }
+
+        for (auto block: body) _depth[block]++;
+    }
+}
+
 }
@@ -24,6 +24,8 @@ const char* Dot_printer::opcode_name(uint16_t opcode) {
         CASE(load_memory)
         CASE(store_memory)
         CASE(call)
+        CASE(push_return)
+        CASE(add_instret)
         CASE(neg)
         case Opcode::i_not: return "not";
         CASE(add)
@@ -0,0 +1,75 @@
+#include <algorithm>
+
+#include "ir/analysis.h"
+#include "ir/visit.h"
+
+namespace ir::analysis {
+
+void Global_value_numbering::process(Node* block) {
+    std::vector<Node*> phis;
+    for (auto ref: block->value(0).references()) {
+        if (ref->opcode() == Opcode::phi) phis.push_back(ref);
+    }
+
+    // PHI nodes already numbered in this block.
+    std::vector<Node*> numbered;
+    for (auto phi: phis) {
+        auto value = phi->value(0);
+
+        // A PHI node whose operands are all the same value, apart from itself, is that value. The value must dominate
+        // all predecessors and hence the block.
+        Value unique;
+        bool trivial = true;
+        for (size_t i = 1; i < phi->operand_count(); i++) {
+            auto operand = phi->operand(i);
+            if (operand == value || operand == unique) continue;
+            if (unique) {
+                trivial = false;
+                break;
+            }
+            unique = operand;
+        }
+
+        if (trivial) {
+            ASSERT(unique);
+            replace_value(value, unique);
+            phi->operands({});
+            _changed = true;
+            continue;
+        }
+
+        // PHI nodes in the same block with the same operands are equal.
+        auto equal = std::find_if(numbered.begin(), numbered.end(), [phi](Node* other) {
+            if (other->value(0).type() != phi->value(0).type()) return false;
+            for (size_t i = 1; i < phi->operand_count(); i++) {
+                if (other->operand(i) != phi->operand(i)) return false;
+            }
+            return true;
+        });
+        if (equal != numbered.end()) {
+            replace_value(value, (*equal)->value(0));
+            phi->operands({});
+            _changed = true;
+            continue;
+        }
+
+        numbered.push_back(phi);
+    }
+
+    // Visit in dominator tree order, so values replaced above are seen by the PHI nodes below.
+    for (auto next: _block_analysis.blocks()) {
+        if (_dom.immediate_dominator(next) == block) process(next);
+    }
+}
+
+void Global_value_numbering::run() {
+
+    // Replacing a PHI node can make PHI nodes around the same loop trivial, so repeat until nothing changes.
+    auto entry = Block::get_target(_graph.entry()->value(0));
+    do {
+        _changed = false;
+        process(entry);
+    } while (_changed);
+}
+
+}
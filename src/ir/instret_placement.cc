@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <limits>
+
+#include "emu/state.h"
+#include "ir/analysis.h"
+#include "ir/builder.h"
+#include "ir/visit.h"
+#include "util/reverse_iterable.h"
+
+namespace ir::analysis {
+
+void Instret_placement::compute_order() {
+    auto entry = *_graph.entry()->value(0).references().begin();
+
+    // Iterative depth-first search. The second element is the index of the next successor to visit.
+    std::vector<std::pair<Node*, size_t>> stack { {entry, 0} };
+    std::unordered_map<Node*, bool> visited { {entry, true} };
+    while (!stack.empty()) {
+        auto& [block, next] = stack.back();
+        auto end = static_cast<Paired*>(block)->mate();
+        if (next == end->value_count()) {
+            _order.push_back(block);
+            stack.pop_back();
+            continue;
+        }
+
+        auto target = Block::get_target(end->value(next++));
+        if (target->opcode() == Opcode::exit || visited[target]) continue;
+        visited[target] = true;
+        stack.push_back({target, 0});
+    }
+
+    std::reverse(_order.begin(), _order.end());
+    for (size_t i = 0; i < _order.size(); i++) _index[_order[i]] = i;
+}
+
+void Instret_placement::insert_before(Node* node, int64_t count) {
+    if (count == 0) return;
+    node->operand_set(0, Builder{_graph}.add_instret(node->operand(0), count));
+}
+
+int64_t Instret_placement::accumulate(Node* block, int64_t pending) {
+
+    // Memory nodes of the block are chained through their first operand.
+    std::vector<Node*> memops;
+    for (auto node = static_cast<Paired*>(block)->mate()->operand(0).node(); node != block;
+         node = node->operand(0).node()) {
+        memops.push_back(node);
+    }
+
+    for (auto node: util::reverse_iterable(memops)) {
+        switch (node->opcode()) {
+            case Opcode::add_instret:
+                pending += node->operand(1).const_value();
+                replace_value(node->value(0), node->operand(0));
+                node->operands({});
+                break;
+            case Opcode::load_memory:
+            case Opcode::store_memory:
+                // Helpers fault outside translated code, where guest state cannot be reconstructed.
+                if (emu::state::no_direct_memory_access) {
+                    insert_before(node, pending);
+                    pending = 0;
+                }
+                static_cast<Memory_access*>(node)->instret(static_cast<Memory_access*>(node)->instret() + pending);
+                break;
+            case Opcode::call:
+                if (static_cast<Call*>(node)->need_context()) {
+                    insert_before(node, pending);
+                    pending = 0;
+                }
+                break;
+            default: break;
+        }
+    }
+
+    return pending;
+}
+
+void Instret_placement::run() {
+    compute_order();
+
+    // Pending counts at the start of blocks are the minimum over predecessors visited earlier, so only the more
+    // expensive paths add the difference when they join. Edges from blocks visited later, i.e. back edges, add whatever
+    // is needed to reach the count expected by their target.
+    for (auto block: _order) {
+        int64_t pending = std::numeric_limits<int64_t>::max();
+        for (auto operand: block->operands()) {
+            if (operand.opcode() == Opcode::entry) {
+                pending = std::min<int64_t>(pending, 0);
+                continue;
+            }
+
+            auto pred = static_cast<Paired*>(operand.node())->mate();
+            if (_index[pred] >= _index[block]) continue;
+            pending = std::min(pending, _pending_out[pred] - _hoisted[pred]);
+        }
+        ASSERT(pending != std::numeric_limits<int64_t>::max());
+        _pending_in[block] = pending;
+        pending = accumulate(block, pending);
+        _pending_out[block] = pending;
+
+        // The other edge of the branch, typically leaving the loop, then starts with a smaller pending count.
+        auto end = static_cast<Paired*>(block)->mate();
+        if (end->opcode() == Opcode::i_if) {
+            for (auto value: end->values()) {
+                auto target = Block::get_target(value);
+                if (target->opcode() != Opcode::exit && _index[target] <= _index[block]) {
+                    _hoisted[block] = pending - _pending_in[target];
+                    break;
+                }
+            }
+        }
+    }
+
+    // Place additions on the edges.
+    for (auto block: _order) {
+        auto end = static_cast<Paired*>(block)->mate();
+        int64_t pending = _pending_out[block];
+
+        if (end->opcode() == Opcode::jmp) {
+            auto target = Block::get_target(end->value(0));
+            int64_t count = target->opcode() == Opcode::exit ? pending : pending - _pending_in[target];
+
+            // Keep the store to pc last in tail jumps, where it is looked for by the code generator.
+            auto last = end->operand(0).node();
+            insert_before(last->opcode() == Opcode::store_register ? last : end, count);
+            continue;
+        }
+
+        ASSERT(end->opcode() == Opcode::i_if);
+        insert_before(end, _hoisted[block]);
+        pending -= _hoisted[block];
+        for (auto value: end->values()) {
+            auto target = Block::get_target(value);
+            ASSERT(target->opcode() == Opcode::block);
+            int64_t count = pending - _pending_in[target];
+            if (count == 0) continue;
+            auto new_block = _block_analysis.split_edge(value);
+            insert_before(static_cast<Paired*>(new_block)->mate(), count);
+        }
+    }
+}
+
+}
@@ -1,4 +1,5 @@
 #include "ir/analysis.h"
+#include "ir/builder.h"
 #include "ir/visit.h"
 
 #include "emu/state.h"
@@ -16,6 +17,30 @@ void Load_store_elimination::populate_memops() {
     }
 }
 
+void Load_store_elimination::preload(Node* block) {
+    size_t regcount = _value_stack.size();
+    std::vector<uint8_t> loaded(regcount);
+    for (auto& pair: _memops) {
+        for (auto node: pair.second) {
+            if (node->opcode() == Opcode::load_register) {
+                loaded[static_cast<Register_access*>(node)->regnum()] = 1;
+            }
+        }
+    }
+
+    auto end = static_cast<Paired*>(block)->mate();
+    auto memory = end->operand(0);
+    auto& memops = _memops[block];
+    Builder builder{_graph};
+    for (uint16_t regnum = 0; regnum < regcount; regnum++) {
+        if (!loaded[regnum]) continue;
+        memory = std::get<0>(builder.load_register(memory, regnum));
+        memops.push_back(memory.node());
+    }
+    end->operand_set(0, memory);
+    _preheader = block;
+}
+
 // First renaming pass. Fill operands of PHI nodes only.
 void Load_store_elimination::fill_load_phi(Node* block) {
 
@@ -121,12 +146,12 @@ void Load_store_elimination::rename_load(Node* block) {
             uint16_t regnum = static_cast<Register_access*>(item)->regnum();
             auto value = _value_stack[regnum].back();
 
-            // Do not actually add PHI nodes into the graph unless enable_phi is on, and also do not replace a load
+            // Do not actually add PHI nodes into the graph unless _enable_phi is on, and also do not replace a load
             // with a value from other blocks (controlled by not_first) for now as register allocator cannot handle
             // them efficiently yet. An exception here is constant. We can always propagate constants across multiple
             // blocks.
             if (value && (not_first[regnum] || value.is_const()) &&
-                (emu::state::enable_phi || value.opcode() != Opcode::phi)) {
+                (_enable_phi || value.opcode() != Opcode::phi)) {
 
                 replace_value(item->value(0), item->operand(0));
                 replace_value(item->value(1), value);
@@ -261,6 +286,21 @@ void Load_store_elimination::eliminate_load() {
     }
 
     _phis = std::vector<std::unordered_map<Node*, Node*>>();
+
+    // Remove loads added by preload that are only used by PHI nodes which no load ended up using.
+    if (_preheader) {
+        auto& memops = _memops[_preheader];
+        memops.erase(std::remove_if(memops.begin(), memops.end(), [](Node* item) {
+            if (item->opcode() != Opcode::load_register) return false;
+            std::vector<Node*> refs(item->value(1).references().begin(), item->value(1).references().end());
+            for (auto ref: refs) {
+                if (ref->opcode() != Opcode::phi || !ref->value(0).references().empty()) return false;
+            }
+            for (auto ref: refs) ref->operands({});
+            replace_value(item->value(0), item->operand(0));
+            return true;
+        }), memops.end());
+    }
 }
 
 // First renaming pass. Fill operands of PHI nodes but no not touch the graph.
@@ -0,0 +1,116 @@
+#include "emu/state.h"
+#include "ir/analysis.h"
+#include "ir/builder.h"
+#include "ir/visit.h"
+
+namespace ir::analysis {
+
+std::pair<Value, int64_t> Memory_load_store_elimination::decompose(Value address) {
+    if (address.is_const()) return {{}, static_cast<int64_t>(address.const_value())};
+
+    // Value numbering has already folded chains of additions and moved constants to the right.
+    if (address.opcode() == Opcode::add && address.node()->operand(1).is_const()) {
+        return {address.node()->operand(0), static_cast<int64_t>(address.node()->operand(1).const_value())};
+    }
+
+    return {address, 0};
+}
+
+Value Memory_load_store_elimination::forward(Node* load) {
+    auto [base, offset] = decompose(load->operand(1));
+    auto type = load->value(1).type();
+    int64_t size = get_type_size(type) / 8;
+
+    auto node = load->operand(0).node();
+    while (true) {
+        switch (node->opcode()) {
+            case Opcode::store_memory: {
+                auto [store_base, store_offset] = decompose(node->operand(1));
+                auto value = node->operand(2);
+                int64_t store_size = get_type_size(value.type()) / 8;
+                if (store_base != base) return {};
+
+                // Disjoint, so the store can be stepped over.
+                if (store_offset + store_size <= offset || offset + size <= store_offset) break;
+
+                // Guest memory is little-endian, so a narrower load from the same address reads the lower bits.
+                if (store_offset != offset || store_size < size) return {};
+                return store_size == size ? value : Builder{_graph}.cast(type, false, value);
+            }
+            case Opcode::load_memory: {
+                auto [load_base, load_offset] = decompose(node->operand(1));
+                if (load_base == base && load_offset == offset && node->value(1).type() == type) return node->value(1);
+                break;
+            }
+            case Opcode::call:
+                return {};
+            case Opcode::block:
+                // Follow the only predecessor. Values available at its end are available here as well.
+                if (node->operand_count() != 1 || node->operand(0).opcode() == Opcode::entry) return {};
+                node = node->operand(0).node()->operand(0).node();
+                continue;
+            default: break;
+        }
+        node = node->operand(0).node();
+    }
+}
+
+void Memory_load_store_elimination::eliminate_load() {
+    for (auto block: _block_analysis.blocks()) {
+        auto end = static_cast<Paired*>(block)->mate();
+        visit_local_memops_postorder(end, [&](Node* node) {
+            if (node->opcode() != Opcode::load_memory) return;
+            auto value = forward(node);
+            if (!value) return;
+            replace_value(node->value(0), node->operand(0));
+            replace_value(node->value(1), value);
+        });
+    }
+}
+
+void Memory_load_store_elimination::eliminate_store() {
+    for (auto block: _block_analysis.blocks()) {
+        auto end = static_cast<Paired*>(block)->mate();
+
+        std::vector<Node*> memops;
+        visit_local_memops_postorder(end, [&](Node* node) {
+            memops.push_back(node);
+        });
+
+        for (size_t i = 0; i < memops.size(); i++) {
+            auto store = memops[i];
+            if (store->opcode() != Opcode::store_memory) continue;
+            auto [base, offset] = decompose(store->operand(1));
+            int64_t size = get_type_size(store->operand(2).type()) / 8;
+
+            bool dead = false;
+            for (size_t j = i + 1; j < memops.size(); j++) {
+                auto node = memops[j];
+                if (node->opcode() == Opcode::store_memory) {
+                    auto [next_base, next_offset] = decompose(node->operand(1));
+                    int64_t next_size = get_type_size(node->operand(2).type()) / 8;
+                    if (next_base == base && next_offset <= offset && offset + size <= next_offset + next_size) {
+                        dead = true;
+                        break;
+                    }
+
+                } else if (node->opcode() == Opcode::load_memory) {
+                    auto [load_base, load_offset] = decompose(node->operand(1));
+                    int64_t load_size = get_type_size(node->value(1).type()) / 8;
+                    if (load_base != base || (load_offset < offset + size && offset < load_offset + load_size)) break;
+
+                } else if (node->opcode() == Opcode::call) {
+                    break;
+                }
+
+                // Any memory access could fault, after which the store must be visible under precise exceptions.
+                if (emu::state::strict_exception && node->opcode() != Opcode::load_register &&
+                    node->opcode() != Opcode::store_register) break;
+            }
+
+            if (dead) replace_value(store->value(0), store->operand(0));
+        }
+    }
+}
+
+}
@@ -140,6 +140,16 @@ Graph Graph::clone() const {
                     {}
                 );
                 break;
+            case Opcode::load_memory:
+            case Opcode::store_memory:
+                result = new Memory_access(
+                    static_cast<Memory_access*>(node)->pc(),
+                    static_cast<Memory_access*>(node)->instret(),
+                    node->_opcode,
+                    Node::Type_container(node->_type),
+                    {}
+                );
+                break;
             case Opcode::block:
             case Opcode::jmp:
             case Opcode::i_if:
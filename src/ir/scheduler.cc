@@ -29,6 +29,7 @@ void Scheduler::schedule_node_early(Node* node) {
                     // For nodes ready for the first time, schedule it.
                     if (remaining == 0) {
                         _list->push_back(ref);
+                        _early[ref] = _block;
                         schedule_node_early(ref);
                     }
                     break;
@@ -60,10 +61,34 @@ void Scheduler::schedule_node_late(Node* node) {
     }
 
     ASSERT(block);
+    block = hoist(node, block);
     _late[node] = block;
     _nodelist[block].push_back(node);
 }
 
+Node* Scheduler::hoist(Node* node, Node* block) {
+
+    // Only pure nodes can be moved, but division faults on a zero divisor, which its guarding branch may rule out.
+    // Comparisons are emitted by their users, and target-specific nodes may be folded into theirs, so keep them too.
+    if (!is_pure_opcode(node->opcode()) || node->opcode() == Opcode::div || node->opcode() == Opcode::divu) {
+        return block;
+    }
+    for (auto value: node->values()) {
+        if (value.type() == Type::i1) return block;
+    }
+
+    // Any block on the dominator tree path between the early and late placement is valid. Pick the one outside as
+    // many loops as possible, and otherwise the latest, so loop-invariant nodes are computed once before the loop.
+    auto best = block;
+    auto early = _early[node];
+    for (auto current = block; current != early && _loops.depth(best) != 0;) {
+        current = _dominance.immediate_dominator(current);
+        if (!current) break;
+        if (_loops.depth(current) < _loops.depth(best)) best = current;
+    }
+    return best;
+}
+
 void Scheduler::schedule_block(Node* block) {
 
     // Schedule all nodes that depends on control flow reaching the block.
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <iterator>
+
 #include "emu/state.h"
 #include "emu/mmu.h"
 #include "emu/unwind.h"
@@ -11,7 +14,6 @@
 #include "util/assert.h"
 #include "util/code_buffer.h"
 #include "util/format.h"
-#include "util/functional.h"
 #include "util/memory.h"
 #include "x86/builder.h"
 #include "x86/disassembler.h"
@@ -22,10 +24,6 @@
 // Shorthand for instruction coding.
 using namespace x86::builder;
 
-// Declare the exception handling registration functions.
-extern "C" void __register_frame(void*);
-extern "C" void __deregister_frame(void*);
-
 // Denotes a translated block.
 struct Dbt_block {
 
@@ -38,14 +36,16 @@ struct Dbt_block {
     // Specify the mapping between RISC-V instruction and x86 instruction.
     std::vector<uint8_t> pc_map;
 
-    // Exception handling frame
-    std::unique_ptr<uint8_t[]> cie;
+    // Trampolines that have been patched to jump into this block. They are restored when the block is removed.
+    std::vector<std::byte*> incoming;
 
-    ~Dbt_block() {
-        if (cie) {
-            __deregister_frame(cie.get());
-        }
-    }
+    // Guest pages the block is translated from.
+    std::vector<emu::reg_t> pages;
+
+    // Remaining executions before the block asks to be promoted. Only used when Dbt_runtime is a lower tier.
+    int32_t countdown = 0;
+
+    Dbt_block(util::Code_cache& cache): code{cache} {}
 };
 
 // A separate class is used instead of generating code directly in Dbt_runtime, so it is easier to define and use
@@ -56,6 +56,12 @@ private:
     Dbt_block& block_;
     x86::Encoder encoder_;
 
+    // Offsets of trampolines in the code buffer. Their addresses are filled in after all code is emitted.
+    std::vector<size_t> trampoline_loc_;
+
+    // Offsets of immediates in the code buffer that should be filled with the address of the return stub.
+    std::vector<size_t> return_stub_use_;
+
     Dbt_compiler& operator <<(const x86::Instruction& inst);
 
     /* Helper functions */
@@ -63,6 +69,10 @@ private:
     void emit_move32(int rd, int rs);
     void emit_load_immediate(int rd, riscv::reg_t imm);
     void emit_branch(riscv::Instruction inst, riscv::reg_t pc_diff, x86::Condition_code cc);
+    void emit_trampoline();
+    void emit_edge_count(riscv::reg_t pc_diff);
+    void emit_push_return(riscv::reg_t pc_diff);
+    void emit_pop_return();
 
     /* Translated instructions */
     void emit_jalr(riscv::Instruction inst, riscv::reg_t pc_diff);
@@ -111,9 +121,28 @@ private:
 public:
     Dbt_compiler(Dbt_runtime& runtime, Dbt_block& block): runtime_{runtime}, block_{block}, encoder_{block.code} {}
     void compile(emu::reg_t pc);
-    void generate_eh_frame();
 };
 
+// Make pc and instret of the context, which are only updated at the end of each block, point to the instruction at the
+// host address. pc_map serves as the side table, giving the length of host code of each guest instruction.
+static void restore_guest_state(const Dbt_block& block, riscv::Context& ctx, uint64_t host_pc) noexcept {
+    // Calculate the index and offset of the trapping instruction.
+    uint64_t host_offset = host_pc - reinterpret_cast<uint64_t>(block.code.data());
+    size_t guest_offset = 0, i;
+    for (i = 0; i < block.pc_map.size(); i++) {
+        if (host_offset < block.pc_map[i]) {
+            break;
+        }
+        host_offset -= block.pc_map[i];
+        guest_offset += block.block.instructions[i].length();
+    }
+    ASSERT(i < block.pc_map.size());
+
+    // Make sure emulated CPU state is consistency.
+    ctx.instret += i;
+    ctx.pc += guest_offset;
+}
+
 _Unwind_Reason_Code dbt_personality(
     [[maybe_unused]] int version,
     _Unwind_Action actions,
@@ -130,75 +159,229 @@ _Unwind_Reason_Code dbt_personality(
 
         // Cleanup phase.
 
-        // First retrieve the associated Dbt_block by reading from LSDA.
-        Dbt_block& block = *reinterpret_cast<Dbt_block*>(_Unwind_GetLanguageSpecificData(context));
+        // First retrieve the runtime by reading from LSDA, and the block containing the trapping instruction from it.
+        auto& runtime = *reinterpret_cast<Dbt_runtime*>(_Unwind_GetLanguageSpecificData(context));
+        uint64_t current_ip = _Unwind_GetIP(context);
+        Dbt_block& block = runtime.block_at(reinterpret_cast<std::byte*>(current_ip));
 
         // Retrive the runtime context by reading register RBP, which has id 5.
         riscv::Context* ctx = reinterpret_cast<riscv::Context*>(_Unwind_GetGR(context, 5));
 
-        // Calculate the index and offset of the trapping instruction.
-        uint64_t current_ip = _Unwind_GetIP(context);
-        uint64_t host_offset = current_ip - reinterpret_cast<uint64_t>(block.code.data());
-        size_t guest_offset = 0, i;
-        for (i = 0; i < block.pc_map.size(); i++) {
-            if (host_offset < block.pc_map[i]) {
-                break;
-            }
-            host_offset -= block.pc_map[i];
-            guest_offset += block.block.instructions[i].length();
-        }
-        ASSERT(i < block.pc_map.size());
-
-        // Make sure emulated CPU state is consistency.
-        ctx->instret += i;
-        ctx->pc += guest_offset;
+        restore_guest_state(block, *ctx, current_ip);
         return _URC_CONTINUE_UNWIND;
     }
 }
 
-Dbt_runtime::Dbt_runtime() {
-    icache_tag_ = std::unique_ptr<emu::reg_t[]> { new emu::reg_t[4096] };
-    icache_ = std::unique_ptr<std::byte*[]> { new std::byte*[4096] };
-    for (size_t i = 0; i < 4096; i++) {
-        icache_tag_[i] = 0;
-    }
+// Helper functions that are tail-called at the end of a block. As they return to Dbt_runtime::step on behalf of the
+// translated block, they return nullptr to indicate that there is no trampoline to patch.
+static std::byte* dbt_step(riscv::Context* context, riscv::Instruction inst) {
+    riscv::step(context, inst);
+    return nullptr;
+}
+
+static std::byte* dbt_flush_cache(Dbt_runtime* runtime) {
+    runtime->flush_cache();
+    return nullptr;
+}
+
+// All frames of translated code only consist of the saved rbp and the return address.
+static constexpr std::initializer_list<uint8_t> cfa_instructions = {
+    // def_cfa_offset(16)
+    0x0E, 0x10,
+    // offset(rbp, cfa-16)
+    0x86, 0x02,
+};
+
+Dbt_runtime::Dbt_runtime(int promotion_threshold, emu::Edge_profile* profile):
+    icache_{emu::state::icache_size, emu::state::icache_ways}, code_cache_{emu::state::code_cache_limit},
+    eh_frame_{code_cache_.base(), code_cache_.limit(), reinterpret_cast<void*>(dbt_personality), this, cfa_instructions},
+    promotion_threshold_{promotion_threshold}, profile_{profile} {
+
+    add_translated_code(code_cache_.base(), code_cache_.limit(), this);
 }
 
 // Necessary as Dbt_block is incomplete in header.
-Dbt_runtime::~Dbt_runtime() {}
+Dbt_runtime::~Dbt_runtime() {
+    remove_translated_code(this);
+    if (emu::state::monitor_performance) {
+        icache_.print_statistics("DBT");
+        code_cache_.print_statistics("DBT");
+    }
+}
 
 void Dbt_runtime::step(riscv::Context& context) {
+    // Drop translations of guest code that has been modified or unmapped.
+    if (UNLIKELY(emu::code_modified)) invalidate_code();
+
+    run(context);
+}
+
+void Dbt_runtime::run(riscv::Context& context) {
     const emu::reg_t pc = context.pc;
-    const ptrdiff_t tag = (pc >> 1) & 4095;
 
     // If the cache misses, compile the current block.
-    if (UNLIKELY(icache_tag_[tag] != pc)) {
-        compile(pc);
-    }
+    std::byte* code = icache_.lookup(pc);
+    if (UNLIKELY(!code)) code = compile(pc);
 
-    auto func = reinterpret_cast<void(*)(riscv::Context&)>(icache_[tag]);
+    // The return value is the address to patch.
+    auto func = reinterpret_cast<Compiled_function>(code);
     ASSERT(func);
-    func(context);
-    return;
+    if (UNLIKELY(code_ptr_to_patch_)) patch_trampoline(pc, func);
+    code_ptr_to_patch_ = func(context);
+}
+
+void Dbt_runtime::patch_trampoline(emu::reg_t pc, Compiled_function func) {
+    // Patch the trampoline.
+    // mov rax, i64 => 48 B8 i64
+    // jmp rax => FF E0
+    // 8 here indicates the length of the prologue.
+    util::write_as<uint16_t>(code_ptr_to_patch_, 0xB848);
+    util::write_as<uint64_t>(code_ptr_to_patch_ + 2, reinterpret_cast<uint64_t>(func) + 8);
+    util::write_as<uint16_t>(code_ptr_to_patch_ + 10, 0xE0FF);
+
+    // Remember the link so it can be undone if either block is removed.
+    (*inst_cache_.find(pc))->incoming.push_back(code_ptr_to_patch_);
+    links_[code_ptr_to_patch_] = pc;
+}
+
+void Dbt_runtime::remove_block(emu::reg_t pc) {
+    auto block_ptr = inst_cache_.find(pc);
+    if (!block_ptr) return;
+
+    auto& block = **block_ptr;
+    std::byte* begin = block.code.data();
+    std::byte* end = begin + block.code.size();
+    auto inside = [begin, end](const std::byte* ptr) { return ptr >= begin && ptr < end; };
+
+    // Restore trampolines in other blocks that jump into this block, so they return to the dispatcher.
+    // pop rbp => 5D
+    // mov rax, .trampoline => 48 B8 i64
+    // ret => C3
+    for (auto trampoline: block.incoming) {
+        if (inside(trampoline)) continue;
+        util::write_as<uint8_t>(trampoline, 0x5D);
+        util::write_as<uint16_t>(trampoline + 1, 0xB848);
+        util::write_as<uint64_t>(trampoline + 3, reinterpret_cast<uint64_t>(trampoline));
+        util::write_as<uint8_t>(trampoline + 11, 0xC3);
+        links_.erase(trampoline);
+    }
+
+    // Links out of this block disappear with its code.
+    auto links_begin = links_.lower_bound(begin);
+    auto links_end = links_.lower_bound(end);
+    for (auto link = links_begin; link != links_end; ++link) {
+        if (link->second == pc) continue;
+        auto& incoming = (*inst_cache_.find(link->second))->incoming;
+        incoming.erase(std::remove(incoming.begin(), incoming.end(), link->first), incoming.end());
+    }
+    links_.erase(links_begin, links_end);
+
+    for (auto page: block.pages) {
+        auto& blocks = page_blocks_[page];
+        blocks.erase(std::remove(blocks.begin(), blocks.end(), pc), blocks.end());
+        if (blocks.empty()) page_blocks_.erase(page);
+    }
+
+    icache_.erase(pc);
+    if (inside(code_ptr_to_patch_)) code_ptr_to_patch_ = nullptr;
+
+    code_blocks_.erase(begin);
+    inst_cache_.erase(pc);
+}
+
+void Dbt_runtime::evict_generation() {
+    auto [begin, end] = code_cache_.next_generation();
+
+    std::vector<emu::reg_t> evicted;
+    for (auto iter = code_blocks_.lower_bound(begin); iter != code_blocks_.end() && iter->first < end; ++iter) {
+        evicted.push_back(iter->second);
+    }
+
+    for (auto pc: evicted) remove_block(pc);
+    return_stack_.clear();
+    code_cache_.advance();
+}
+
+void Dbt_runtime::invalidate(emu::reg_t start, emu::reg_t end) {
+    std::vector<emu::reg_t> invalidated;
+    for (
+        auto iter = page_blocks_.lower_bound(start &~ emu::page_mask);
+        iter != page_blocks_.end() && iter->first < end;
+        ++iter
+    ) {
+        invalidated.insert(invalidated.end(), iter->second.begin(), iter->second.end());
+    }
+
+    // A block spanning multiple pages may appear more than once, but it is only found the first time.
+    for (auto pc: invalidated) remove_block(pc);
+    return_stack_.clear();
 }
 
-void Dbt_runtime::compile(emu::reg_t pc) {
-    const ptrdiff_t tag = (pc >> 1) & 4095;
+void Dbt_runtime::invalidate_code() {
+    for (auto [start, end]: emu::take_modified_code_ranges()) {
+        invalidate(start, end);
+    }
+}
+
+bool Dbt_runtime::is_hot(emu::reg_t pc) {
+    auto block_ptr = inst_cache_.find(pc);
+    return block_ptr && (*block_ptr)->countdown <= 0;
+}
+
+Dbt_block& Dbt_runtime::block_at(std::byte* host_pc) {
+    auto iter = code_blocks_.upper_bound(host_pc);
+    ASSERT(iter != code_blocks_.begin());
+    return **inst_cache_.find(std::prev(iter)->second);
+}
+
+void Dbt_runtime::restore_fault_state(std::byte* host_pc, const greg_t* registers) noexcept {
+    // Translated code keeps context + 0x80 in rbp.
+    auto& context = *reinterpret_cast<riscv::Context*>(registers[REG_RBP] - 0x80);
+    restore_guest_state(block_at(host_pc), context, reinterpret_cast<uint64_t>(host_pc));
+}
+
+void Dbt_runtime::retire(emu::reg_t pc) {
+    remove_block(pc);
+    return_stack_.clear();
+}
+
+std::byte* Dbt_runtime::compile(emu::reg_t pc) {
     auto& block_ptr = inst_cache_[pc];
 
-    // Reserve a page in case that the buffer is empty, it saves the code buffer from reallocating (which is expensive
-    // as code buffer is backed up by mmap and munmap at the moment.
-    // If buffer.size() is not zero, it means that we have compiled the code previously but it is not in the hot cache.
+    // If block_ptr is not null, it means that we have compiled the code previously but it is not in the hot cache.
     if (!block_ptr) {
-        block_ptr = std::make_unique<Dbt_block>();
-        block_ptr->code.reserve(4096);
-        Dbt_compiler compiler { *this, *block_ptr };
-        compiler.compile(pc);
+        block_ptr = std::make_unique<Dbt_block>(code_cache_);
+        try {
+            block_ptr->code.reserve(4096);
+            Dbt_compiler compiler { *this, *block_ptr };
+            compiler.compile(pc);
+        } catch (const std::bad_alloc&) {
+            // The current generation is full. Evict the oldest one and retry there, unless the block does not fit even in
+            // an empty generation.
+            inst_cache_.erase(pc);
+            if (code_cache_.generation_empty()) throw;
+            evict_generation();
+            return compile(pc);
+        }
+
+        // Write-protect the guest pages, so the block is dropped if they are modified.
+        auto& guest_block = block_ptr->block;
+        for (
+            emu::reg_t page = guest_block.start_pc &~ emu::page_mask;
+            page < guest_block.end_pc;
+            page += emu::page_size
+        ) {
+            block_ptr->pages.push_back(page);
+            page_blocks_[page].push_back(pc);
+            emu::track_code_page(page);
+        }
+
+        code_blocks_[block_ptr->code.data()] = pc;
     }
 
     // Update tag to reflect newly compiled code.
-    icache_[tag] = block_ptr->code.data();
-    icache_tag_[tag] = pc;
+    icache_.insert(pc, block_ptr->code.data());
+    return block_ptr->code.data();
 }
 
 Dbt_compiler& Dbt_compiler::operator <<(const x86::Instruction& inst) {
@@ -216,7 +399,8 @@ Dbt_compiler& Dbt_compiler::operator <<(const x86::Instruction& inst) {
     return *this;
 }
 
-#define memory_of_register(reg) (x86::Register::rbp + (offsetof(riscv::Context, registers) + sizeof(emu::reg_t) * reg - 0x80))
+#define memory_of_register(reg) \
+    (x86::Register::rbp + static_cast<uint32_t>(offsetof(riscv::Context, registers) + sizeof(emu::reg_t) * reg - 0x80))
 #define memory_of(name) (x86::Register::rbp + (offsetof(riscv::Context, name) - 0x80))
 
 void Dbt_compiler::compile(emu::reg_t pc) {
@@ -233,6 +417,23 @@ void Dbt_compiler::compile(emu::reg_t pc) {
     *this << push(x86::Register::rbp);
     *this << lea(x86::Register::rbp, qword(x86::Register::rdi + 0x80));
 
+    // Chained blocks jump past the prologue, so its length must agree with Dbt_runtime::patch_trampoline.
+    ASSERT(block_.code.size() == 8);
+
+    // As a lower tier, count down executions and return to the dispatcher once the block becomes hot. This is placed
+    // after the prologue so chained entries are counted as well.
+    if (runtime_.promotion_threshold_) {
+        block_.countdown = runtime_.promotion_threshold_;
+        *this << mov(x86::Register::rax, reinterpret_cast<uintptr_t>(&block_.countdown));
+        *this << sub(dword(x86::Register::rax + 0), 1);
+        *this << jcc(x86::Condition_code::not_equal, 0xAAAA);
+        size_t jcc_end = block_.code.size();
+        *this << pop(x86::Register::rbp);
+        *this << i_xor(x86::Register::eax, x86::Register::eax);
+        *this << ret();
+        util::write_as<uint32_t>(block_.code.data() + jcc_end - 4, block_.code.size() - jcc_end);
+    }
+
     int pc_diff = 0;
     int instret_diff = 0;
 
@@ -337,7 +538,8 @@ void Dbt_compiler::compile(emu::reg_t pc) {
     pc_diff += inst.length();
     instret_diff += 1;
 
-    if (!emu::state::no_instret) {
+    // As a lower tier, blocks always count, since the upper tier keeps instret precise.
+    if (!emu::state::no_instret || runtime_.promotion_threshold_) {
         *this << add(qword(memory_of(instret)), instret_diff);
     }
 
@@ -353,7 +555,7 @@ void Dbt_compiler::compile(emu::reg_t pc) {
         case riscv::Opcode::fence_i: {
             *this << add(qword(memory_of(pc)), pc_diff);
             *this << mov(x86::Register::rdi, reinterpret_cast<uintptr_t>(&runtime_));
-            *this << mov(x86::Register::rax, reinterpret_cast<uintptr_t>(AS_FUNCTION_POINTER(&Dbt_runtime::flush_cache)));
+            *this << mov(x86::Register::rax, reinterpret_cast<uintptr_t>(dbt_flush_cache));
             *this << pop(x86::Register::rbp);
             *this << jmp(x86::Register::rax);
             break;
@@ -362,83 +564,34 @@ void Dbt_compiler::compile(emu::reg_t pc) {
             *this << add(qword(memory_of(pc)), pc_diff);
             *this << mov(x86::Register::rsi, util::read_as<uint64_t>(&inst));
             *this << lea(x86::Register::rdi, qword(x86::Register::rbp - 0x80));
-            *this << mov(x86::Register::rax, reinterpret_cast<uintptr_t>(riscv::step));
+            *this << mov(x86::Register::rax, reinterpret_cast<uintptr_t>(dbt_step));
             *this << pop(x86::Register::rbp);
             *this << jmp(x86::Register::rax);
             break;
     }
 
-    generate_eh_frame();
-}
-
-void Dbt_compiler::generate_eh_frame() {
-    // TODO: Create an dwarf generation to replace this hard-coded template.
-    static const unsigned char cie_template[] = {
-        // CIE
-        // Length
-        0x1C, 0x00, 0x00, 0x00,
-        // CIE
-        0x00, 0x00, 0x00, 0x00,
-        // Version
-        0x01,
-        // Augmentation string
-        'z', 'P', 'L', 0,
-        // Instruction alignment factor = 1
-        0x01,
-        // Data alignment factor = -8
-        0x78,
-        // Return register number
-        0x10,
-        // Augmentation data
-        0x0A, // Data for z
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // abs format, personality routine
-        0x00, // abs format for LSDA
-        // Instructions
-        // def_cfa(rsp, 8)
-        0x0c, 0x07, 0x08,
-        // offset(rsp, cfa-8)
-        0x90, 0x01,
-        // Padding
-
-        // FDE
-        // Length
-        0x24, 0x00, 0x00, 0x00,
-        // CIE Pointer
-        0x24, 0x00, 0x00, 0x00,
-        // Initial location
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        // Augumentation data
-        0x8,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // LSDA
-        // advance_loc(1)
-        0x41,
-        // def_cfa_offset(16)
-        0x0E, 0x10,
-        // offset(rbp, cfa-16)
-        0x86, 0x02,
-        // Padding
-        0x00, 0x00,
-
-        0x00, 0x00, 0x00, 0x00
-    };
-
-    block_.cie = std::make_unique<uint8_t[]>(sizeof(cie_template));
-    uint8_t *cie = block_.cie.get();
-
-    memcpy(cie, cie_template, sizeof(cie_template));
-    util::write_as<uint64_t>(cie + 0x12, reinterpret_cast<uint64_t>(dbt_personality));
-    util::write_as<uint64_t>(cie + 0x28, reinterpret_cast<uint64_t>(block_.code.data()));
-    util::write_as<uint64_t>(cie + 0x30, block_.code.size());
-    util::write_as<uint64_t>(cie + 0x39, reinterpret_cast<uint64_t>(&block_));
-
-    __register_frame(cie);
+    // If a return address is pushed, we need a stub to continue after return. The stub is a trampoline, so it will be
+    // patched to jump to the translated block of the return address after the first return.
+    size_t return_stub_loc = block_.code.size();
+    if (!return_stub_use_.empty()) emit_trampoline();
+
+    // Now the code buffer will no longer be reallocated, fill in addresses of trampolines.
+    for (auto use: return_stub_use_) {
+        util::write_as<uint64_t>(
+            block_.code.data() + use, reinterpret_cast<uint64_t>(block_.code.data()) + return_stub_loc
+        );
+    }
+
+    for (auto loc: trampoline_loc_) {
+        uintptr_t rip = reinterpret_cast<uintptr_t>(block_.code.data()) + loc;
+        util::write_as<uint64_t>(reinterpret_cast<void*>(rip + 3), rip);
+    }
 }
 
 void Dbt_runtime::flush_cache() {
-    for (int i = 0; i < 4096; i++)
-        icache_tag_[i] = 0;
-    inst_cache_.clear();
+    // Writes to other code pages are detected by write protection, so only shared pages need to be invalidated. The
+    // translated code returns to the dispatcher after fence.i, where the invalidation happens.
+    emu::invalidate_shared_code_pages();
 }
 
 void Dbt_compiler::emit_move(int rd, int rs) {
@@ -471,6 +624,49 @@ void Dbt_compiler::emit_load_immediate(int rd, riscv::reg_t imm) {
     *this << mov(qword(memory_of_register(rd)), imm);
 }
 
+void Dbt_compiler::emit_trampoline() {
+    // If the next pc is a constant we would like to jump to the translated block directly. As it may not be
+    // translated yet, we generate
+    // .trampoline:
+    //     mov rax, .trampoline
+    //     ret
+    // And Dbt_runtime will replace the trampoline with the jump once the target is known.
+    trampoline_loc_.push_back(block_.code.size());
+    *this << pop(x86::Register::rbp);
+    *this << mov(x86::Register::rax, 0xCCCCCCCCC);
+    *this << ret();
+}
+
+void Dbt_compiler::emit_push_return(riscv::reg_t pc_diff) {
+    // Locate the entry using the stack pointer.
+    *this << mov(x86::Register::rax, qword(memory_of_register(2)));
+    *this << i_and(x86::Register::eax, emu::Return_stack::mask);
+    *this << mov(x86::Register::rdx, reinterpret_cast<uintptr_t>(runtime_.return_stack_.entries));
+    *this << add(x86::Register::rdx, x86::Register::rax);
+
+    // Fill in the return address and the stub to continue at. The latter is filled in when code is finalized.
+    *this << mov(x86::Register::rax, block_.block.start_pc + pc_diff);
+    *this << mov(qword(x86::Register::rdx + 0), x86::Register::rax);
+    *this << mov(x86::Register::rax, 0xCCCCCCCCCCCC);
+    return_stub_use_.push_back(block_.code.size() - 8);
+    *this << mov(qword(x86::Register::rdx + 8), x86::Register::rax);
+}
+
+void Dbt_compiler::emit_pop_return() {
+    // Locate the entry using the stack pointer. The new pc should be in rax already.
+    *this << mov(x86::Register::rcx, qword(memory_of_register(2)));
+    *this << i_and(x86::Register::ecx, emu::Return_stack::mask);
+    *this << mov(x86::Register::rdx, reinterpret_cast<uintptr_t>(runtime_.return_stack_.entries));
+    *this << add(x86::Register::rdx, x86::Register::rcx);
+
+    // If the prediction is correct, continue at the stub recorded by the caller.
+    *this << cmp(x86::Register::rax, qword(x86::Register::rdx + 0));
+    *this << jcc(x86::Condition_code::not_equal, 0xAAAA);
+    size_t jcc_end = block_.code.size();
+    *this << jmp(qword(x86::Register::rdx + 8));
+    util::write_as<uint32_t>(block_.code.data() + jcc_end - 4, block_.code.size() - jcc_end);
+}
+
 void Dbt_compiler::emit_branch(riscv::Instruction inst, riscv::reg_t pc_diff, x86::Condition_code cc) {
     const int rs1 = inst.rs1();
     const int rs2 = inst.rs2();
@@ -486,8 +682,7 @@ void Dbt_compiler::emit_branch(riscv::Instruction inst, riscv::reg_t pc_diff, x8
             *this << add(qword(memory_of(pc)), pc_diff);
         }
 
-        *this << pop(x86::Register::rbp);
-        *this << ret();
+        emit_trampoline();
         return;
     }
 
@@ -512,16 +707,29 @@ void Dbt_compiler::emit_branch(riscv::Instruction inst, riscv::reg_t pc_diff, x8
         *this << cmp(x86::Register::rax, qword(memory_of_register(rs2)));
     }
 
-    // If flag set, then change rax to offset of new target
-    *this << mov(x86::Register::rdx, pc_diff - inst.length() + inst.imm());
-    *this << mov(x86::Register::rax, pc_diff);
-    *this << cmovcc(cc, x86::Register::rax, x86::Register::rdx);
+    // Each side of the branch has its own exit, so both can be chained.
+    *this << jcc(cc, 0xAAAA);
+    size_t jcc_end = block_.code.size();
 
-    // Update pc
-    *this << add(qword(memory_of(pc)), x86::Register::rax);
+    // Not taken.
+    emit_edge_count(pc_diff);
+    *this << add(qword(memory_of(pc)), pc_diff);
+    emit_trampoline();
 
-    *this << pop(x86::Register::rbp);
-    *this << ret();
+    // Taken.
+    util::write_as<uint32_t>(block_.code.data() + jcc_end - 4, block_.code.size() - jcc_end);
+    emit_edge_count(pc_diff - inst.length() + inst.imm());
+    *this << add(qword(memory_of(pc)), pc_diff - inst.length() + inst.imm());
+    emit_trampoline();
+}
+
+void Dbt_compiler::emit_edge_count(riscv::reg_t pc_diff) {
+    if (!runtime_.profile_) return;
+
+    // Counting is done by the guest thread only, so no lock prefix is needed.
+    auto& counter = runtime_.profile_->counter(block_.block.start_pc, block_.block.start_pc + pc_diff);
+    *this << mov(x86::Register::rax, reinterpret_cast<uintptr_t>(&counter));
+    *this << add(dword(x86::Register::rax + 0), 1);
 }
 
 void Dbt_compiler::emit_jalr(riscv::Instruction inst, riscv::reg_t pc_diff) {
@@ -547,7 +755,16 @@ void Dbt_compiler::emit_jalr(riscv::Instruction inst, riscv::reg_t pc_diff) {
         *this << mov(qword(memory_of_register(rd)), x86::Register::rdx);
     }
 
+    // Calls and returns are identified by using ra as link register.
+    if (rd == 1) {
+        emit_push_return(pc_diff);
+    } else if (rd == 0 && rs1 == 1) {
+        emit_pop_return();
+    }
+
+    // Return 0, meaning that nothing needs to be patched.
     *this << pop(x86::Register::rbp);
+    *this << i_xor(x86::Register::eax, x86::Register::eax);
     *this << ret();
 }
 
@@ -565,8 +782,11 @@ void Dbt_compiler::emit_jal(riscv::Instruction inst, riscv::reg_t pc_diff) {
         *this << mov(qword(memory_of_register(rd)), x86::Register::rax);
     }
 
-    *this << pop(x86::Register::rbp);
-    *this << ret();
+    if (rd == 1) {
+        emit_push_return(pc_diff);
+    }
+
+    emit_trampoline();
 }
 
 void Dbt_compiler::emit_lb(riscv::Instruction inst, bool u) {
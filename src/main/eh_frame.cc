@@ -0,0 +1,82 @@
+#include <cstring>
+#include <vector>
+
+#include "main/eh_frame.h"
+#include "util/memory.h"
+
+// Declare the exception handling registration functions.
+extern "C" void __register_frame(void*);
+extern "C" void __deregister_frame(void*);
+
+namespace {
+
+template<typename T>
+void append(std::vector<uint8_t>& data, T value) {
+    size_t size = data.size();
+    data.resize(size + sizeof(T));
+    util::write_as<T>(data.data() + size, value);
+}
+
+}
+
+Eh_frame::Eh_frame(
+    std::byte* begin, size_t size, void* personality, void* lsda, std::initializer_list<uint8_t> instructions
+) {
+    std::vector<uint8_t> data {
+        // CIE
+        // Length
+        0x1C, 0x00, 0x00, 0x00,
+        // CIE
+        0x00, 0x00, 0x00, 0x00,
+        // Version
+        0x01,
+        // Augmentation string
+        'z', 'P', 'L', 0,
+        // Instruction alignment factor = 1
+        0x01,
+        // Data alignment factor = -8
+        0x78,
+        // Return register number
+        0x10,
+        // Augmentation data
+        0x0A, // Data for z
+        0x00, // abs format, personality routine
+    };
+    append(data, reinterpret_cast<uint64_t>(personality));
+    data.insert(data.end(), {
+        0x00, // abs format for LSDA
+        // Instructions
+        // def_cfa(rsp, 8)
+        0x0c, 0x07, 0x08,
+        // offset(rip, cfa-8)
+        0x90, 0x01,
+    });
+
+    // FDE
+    size_t fde = data.size();
+    // Length, filled in below
+    append<uint32_t>(data, 0);
+    // CIE Pointer
+    append<uint32_t>(data, data.size());
+    // Initial location and range
+    append(data, reinterpret_cast<uint64_t>(begin));
+    append<uint64_t>(data, size);
+    // Augumentation data
+    data.push_back(0x08);
+    append(data, reinterpret_cast<uint64_t>(lsda));
+    data.insert(data.end(), instructions);
+    // Padding with nop
+    while ((data.size() - fde) % 8 != 0) data.push_back(0x00);
+    util::write_as<uint32_t>(data.data() + fde, data.size() - fde - 4);
+
+    // Terminator
+    append<uint32_t>(data, 0);
+
+    data_ = std::make_unique<uint8_t[]>(data.size());
+    memcpy(data_.get(), data.data(), data.size());
+    __register_frame(data_.get());
+}
+
+Eh_frame::~Eh_frame() {
+    __deregister_frame(data_.get());
+}
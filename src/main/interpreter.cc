@@ -1,3 +1,4 @@
+#include "emu/mmu.h"
 #include "main/interpreter.h"
 #include "riscv/context.h"
 #include "riscv/decoder.h"
@@ -10,6 +11,8 @@ Interpreter::Interpreter() noexcept {}
 Interpreter::~Interpreter() {}
 
 void Interpreter::step(riscv::Context& context) {
+    if (UNLIKELY(emu::code_modified)) invalidate_code();
+
     emu::reg_t pc = context.pc;
     riscv::Basic_block& basic_block = inst_cache_[pc];
 
@@ -17,6 +20,15 @@ void Interpreter::step(riscv::Context& context) {
         riscv::Decoder decoder {pc};
         basic_block = decoder.decode_basic_block();
 
+        // Register the pages, so decoded blocks are dropped when they are remapped or modified.
+        for (
+            emu::reg_t page = basic_block.start_pc &~ emu::page_mask;
+            page < basic_block.end_pc;
+            page += emu::page_size
+        ) {
+            emu::track_code_page(page);
+        }
+
         // Function step will assume the pc is pre-incremented, but this is clearly not the case for auipc. Therfore we
         // preprocess all auipc instructions to compensate this.
         for (auto& inst: basic_block.instructions) {
@@ -56,6 +68,18 @@ void Interpreter::step(riscv::Context& context) {
     }
 }
 
+void Interpreter::invalidate_code() {
+    for (auto [start, end]: emu::take_modified_code_ranges()) {
+        for (auto iter = inst_cache_.begin(); iter != inst_cache_.end();) {
+            if (iter->second.start_pc < end && start < iter->second.end_pc) {
+                iter = inst_cache_.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+    }
+}
+
 void Interpreter::flush_cache() {
     inst_cache_.clear();
 }
@@ -1,10 +1,17 @@
+#include <algorithm>
 #include <chrono>
+#include <cstddef>
 #include <cstring>
+#include <optional>
+#include <unordered_set>
+#include <vector>
 
+#include "emu/mmu.h"
 #include "emu/state.h"
 #include "emu/unwind.h"
 #include "ir/analysis.h"
 #include "ir/pass.h"
+#include "main/dbt.h"
 #include "main/ir_dbt.h"
 #include "main/signal.h"
 #include "riscv/basic_block.h"
@@ -19,124 +26,138 @@
 #include "util/memory.h"
 #include "x86/backend.h"
 
-// Declare the exception handling registration functions.
-extern "C" void __register_frame(void*);
-extern "C" void __deregister_frame(void*);
-
 // Denotes a translated block.
 struct Ir_block {
 
     // Translated code.
     util::Code_buffer code;
 
-    // Exception handling frame
-    std::unique_ptr<uint8_t[]> cie;
+    // Trampolines that have been patched to jump into this block. They are restored when the block is removed.
+    std::vector<std::byte*> incoming;
 
-    // Number of times the block is hit. If the number reaches compile_threshold, IR DBT will start to work.
-    int num_hit = 0;
+    // Guest pages the block, including all inlined blocks, is translated from.
+    std::vector<emu::reg_t> pages;
 
-    ~Ir_block() {
-        if (cie) {
-            __deregister_frame(cie.get());
-        }
-    }
+    // Guest state at each memory access, sorted by host offset.
+    std::vector<x86::backend::Memory_access_site> memory_access_sites;
+
+    Ir_block(util::Code_cache& cache): code{cache} {}
+};
+
+// A compiled region up to register allocation. Nothing here refers to the code cache or other state of Ir_dbt, so it
+// can be built on a background thread. Code generation happens when it is installed on the guest thread.
+struct Ir_compilation {
+    emu::reg_t pc;
+
+    // Guest pages the region is translated from.
+    std::vector<emu::reg_t> pages;
+
+    // Whether to keep a copy of the guest code, so modifications made while compiling can be detected.
+    bool snapshot = false;
+    std::vector<std::pair<emu::reg_t, std::vector<std::byte>>> snapshots;
+
+    // Pc of the basic block each tail jump to exit is decoded from, used to look up the edge profile.
+    std::unordered_map<ir::Node*, emu::reg_t> exit_sources;
+
+    // Number of times each decoded basic block left through any of its tail jumps, according to the edge profile.
+    std::unordered_map<emu::reg_t, uint64_t> exit_totals;
+
+    // Basic blocks in natural loops reachable from pc, and headers of these loops.
+    std::unordered_set<emu::reg_t> loop_blocks;
+    std::unordered_set<emu::reg_t> loop_headers;
+
+    ir::Graph graph;
+    std::optional<ir::analysis::Block> block_analysis;
+    std::optional<ir::analysis::Dominance> dom;
+    std::optional<ir::analysis::Scheduler> scheduler;
+    std::optional<x86::backend::Register_allocator> regalloc;
+
+    // Time spent building, in nanoseconds.
+    int64_t time = 0;
 };
 
 _Unwind_Reason_Code ir_dbt_personality(
     [[maybe_unused]] int version,
-    [[maybe_unused]] _Unwind_Action actions,
+    _Unwind_Action actions,
     [[maybe_unused]] uint64_t exception_class,
     [[maybe_unused]] struct _Unwind_Exception *exception_object,
-    [[maybe_unused]] struct _Unwind_Context *context
+    struct _Unwind_Context *context
 ) {
+    // Nothing is caught. In the cleanup phase, the guest state is restored if this frame is the one interrupted by the
+    // fault. Other frames are at a call, where the context is already up to date.
+    if (actions & _UA_CLEANUP_PHASE) {
+        int ip_before_insn = 0;
+        uint64_t current_ip = _Unwind_GetIPInfo(context, &ip_before_insn);
+        if (ip_before_insn) {
+            auto& runtime = *reinterpret_cast<Ir_dbt*>(_Unwind_GetLanguageSpecificData(context));
+
+            // Translated code keeps the context in rbp, which has id 6. Pinned callee-saved registers have the same
+            // DWARF number as their encoding.
+            auto& ctx = *reinterpret_cast<riscv::Context*>(_Unwind_GetGR(context, 6));
+            uint64_t pinned_values[std::size(x86::backend::pinned_registers)];
+            for (size_t i = 0; i < x86::backend::Code_generator::pinned_register_count(); i++) {
+                auto reg = x86::backend::pinned_registers[i].second;
+                pinned_values[i] = _Unwind_GetGR(context, static_cast<uint8_t>(reg) & 0xF);
+            }
+            runtime.restore_guest_state(reinterpret_cast<std::byte*>(current_ip), ctx, pinned_values);
+        }
+    }
     return _URC_CONTINUE_UNWIND;
 }
 
-static void generate_eh_frame(Ir_block& block, int stack_size) {
-    // TODO: Create an dwarf generation to replace this hard-coded template.
-    static const unsigned char cie_template[] = {
-        // CIE
-        // Length
-        0x1C, 0x00, 0x00, 0x00,
-        // CIE
-        0x00, 0x00, 0x00, 0x00,
-        // Version
-        0x01,
-        // Augmentation string
-        'z', 'P', 'L', 0,
-        // Instruction alignment factor = 1
-        0x01,
-        // Data alignment factor = -8
-        0x78,
-        // Return register number
-        0x10,
-        // Augmentation data
-        0x0A, // Data for z
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // abs format, personality routine
-        0x00, // abs format for LSDA
-        // Instructions
-        // def_cfa(rsp, 8)
-        0x0c, 0x07, 0x08,
-        // offset(rsp, cfa-8)
-        0x90, 0x01,
-        // Padding
-
-        // FDE
-        // Length
-        0x28, 0x00, 0x00, 0x00,
-        // CIE Pointer
-        0x24, 0x00, 0x00, 0x00,
-        // Initial location
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        // Augumentation data
-        0x8,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // LSDA
-        // advance_loc(1)
-        0x41,
-        // def_cfa_offset(16)
-        0x0E, 0x10,
-        // offset(rbp, cfa-16)
-        0x86, 0x02,
-        // def_cfa_offset(stack_size+16)
-        0x0E, 0x00, 0x00,
-        // Padding
-        0x00, 0x00, 0x00,
-
-        0x00, 0x00, 0x00, 0x00
-    };
+// Call frame instructions for all IR-translated code. The frame size differs between blocks, so instead of rsp the
+// prologue records the stack pointer in the context, which rbp points to.
+static constexpr size_t host_sp_offset = offsetof(riscv::Context, host_sp);
+static_assert(host_sp_offset < 8192);
+// The prologue pushes rbp and rbx, which holds instret, and pads the stack by 8 bytes.
+static constexpr std::initializer_list<uint8_t> cfa_instructions = {
+    // def_cfa_expression(rbp + host_sp_offset, deref, plus_uconst 32)
+    0x0F, 0x06, 0x76, (host_sp_offset & 127) | 0x80, host_sp_offset >> 7, 0x06, 0x23, 0x20,
+    // offset(rbp, cfa-16), offset(rbx, cfa-24)
+    0x86, 0x02, 0x83, 0x03,
+};
 
-    block.cie = std::make_unique<uint8_t[]>(sizeof(cie_template));
-    uint8_t *cie = block.cie.get();
+// With pinned registers, the prologue also pushes r12 to r15.
+static constexpr std::initializer_list<uint8_t> pinned_cfa_instructions = {
+    // def_cfa_expression(rbp + host_sp_offset, deref, plus_uconst 64)
+    0x0F, 0x06, 0x76, (host_sp_offset & 127) | 0x80, host_sp_offset >> 7, 0x06, 0x23, 0x40,
+    // offset(rbp, cfa-16), offset(rbx, cfa-24), offset(r12, cfa-32), ..., offset(r15, cfa-56)
+    0x86, 0x02, 0x83, 0x03, 0x8C, 0x04, 0x8D, 0x05, 0x8E, 0x06, 0x8F, 0x07,
+};
 
-    memcpy(cie, cie_template, sizeof(cie_template));
-    util::write_as<uint64_t>(cie + 0x12, reinterpret_cast<uint64_t>(ir_dbt_personality));
-    util::write_as<uint64_t>(cie + 0x28, reinterpret_cast<uint64_t>(block.code.data()));
-    util::write_as<uint64_t>(cie + 0x30, 4096);
-    util::write_as<uint64_t>(cie + 0x39, 0);
+Ir_dbt::Ir_dbt():
+    icache_{emu::state::icache_size, emu::state::icache_ways}, code_cache_{emu::state::code_cache_limit},
+    eh_frame_{
+        code_cache_.base(), code_cache_.limit(), reinterpret_cast<void*>(ir_dbt_personality), this,
+        emu::state::pin_registers ? pinned_cfa_instructions : cfa_instructions
+    } {
 
-    // We only have logic for two bytes in LEB127
-    stack_size += 16;
-    ASSERT(stack_size >= 0 && stack_size <= 0x3FFF);
-    if (stack_size <= 127) {
-        cie[0x47] = stack_size;
-    } else {
-        cie[0x47] = (stack_size & 127) | 0x80;
-        cie[0x48] = stack_size >> 7;
+    add_translated_code(code_cache_.base(), code_cache_.limit(), this);
+
+    // Blocks are profiled while they run in a lower tier.
+    if (emu::state::compile_threshold > 0 || emu::state::compile_threads > 0) {
+        profile_ = std::make_unique<emu::Edge_profile>();
     }
 
-    __register_frame(cie);
-}
+    if (emu::state::tiered && emu::state::compile_threshold > 0) {
+        tier1_ = std::make_unique<Dbt_runtime>(emu::state::compile_threshold, profile_.get());
+    }
 
-Ir_dbt::Ir_dbt() noexcept {
-    icache_tag_ = std::make_unique<emu::reg_t[]>(4096);
-    icache_ = std::make_unique<std::byte*[]>(4096);
-    for (size_t i = 0; i < 4096; i++) {
-        icache_tag_[i] = 0;
+    for (int i = 0; i < emu::state::compile_threads; i++) {
+        workers_.emplace_back(&Ir_dbt::work, this);
     }
 }
 
 Ir_dbt::~Ir_dbt() {
+    remove_translated_code(this);
+
+    {
+        std::lock_guard<std::mutex> lock {queue_mutex_};
+        stopping_ = true;
+    }
+    queue_cv_.notify_all();
+    for (auto& worker: workers_) worker.join();
+
     if (emu::state::monitor_performance) {
         int64_t average_in_ns = (total_compilation_time + (total_block_compiled / 2)) / total_block_compiled;
         int64_t average_in_us = (average_in_ns + 500) / 1000;
@@ -145,39 +166,163 @@ Ir_dbt::~Ir_dbt() {
             "{} blocks are compiled in {} microseconds. Time per block is {} microseconds.\n",
             total_block_compiled, sum_in_us, average_in_us
         );
+        icache_.print_statistics("IR DBT");
+        code_cache_.print_statistics("IR DBT");
     }
 }
 
 void Ir_dbt::step(riscv::Context& context) {
     const emu::reg_t pc = context.pc;
-    const ptrdiff_t tag = (pc >> 1) & 4095;
+
+    // Drop translations of guest code that has been modified or unmapped.
+    if (UNLIKELY(emu::code_modified)) invalidate_code();
+
+    // Install code compiled in the background. This is a safe point as no translated code is running.
+    if (UNLIKELY(has_finished_.load(std::memory_order_acquire))) install_finished();
 
     // If the cache misses, compile the current block.
-    if (UNLIKELY(icache_tag_[tag] != pc)) {
+    std::byte* code = icache_.lookup(pc);
+    if (UNLIKELY(!code)) {
         compile(context, pc);
         return;
     }
 
-    // The return value is the address to patch.
-    auto func = reinterpret_cast<Compiled_function>(icache_[tag]);
+    // The return value is the address to patch. Code of the lower tier cannot jump to the code here.
+    auto func = reinterpret_cast<Compiled_function>(code);
     ASSERT(func);
-    if (UNLIKELY(_code_ptr_to_patch)) patch_trampoline(func);
+    if (UNLIKELY(_code_ptr_to_patch)) patch_trampoline(pc, func);
+    if (tier1_) tier1_->cancel_patch();
     _code_ptr_to_patch = func(context);
 }
 
-void Ir_dbt::patch_trampoline(Compiled_function func) {
+void Ir_dbt::patch_trampoline(emu::reg_t pc, Compiled_function func) {
     // Patch the trampoline.
     // mov rax, i64 => 48 B8 i64
     // jmp rax => FF E0
-    // 4 here indicates the length of the prologue.
+    // The prologue is skipped, as the frame is already set up.
     util::write_as<uint16_t>(_code_ptr_to_patch, 0xB848);
-    util::write_as<uint64_t>(_code_ptr_to_patch + 2, reinterpret_cast<uint64_t>(func) + 4);
+    util::write_as<uint64_t>(
+        _code_ptr_to_patch + 2, reinterpret_cast<uint64_t>(func) + x86::backend::Code_generator::prologue_size()
+    );
     util::write_as<uint16_t>(_code_ptr_to_patch + 10, 0xE0FF);
+
+    // Remember the link so it can be undone if either block is removed.
+    inst_cache_.find(pc)->block->incoming.push_back(_code_ptr_to_patch);
+    links_[_code_ptr_to_patch] = pc;
 }
 
-ir::Graph Ir_dbt::decode(emu::reg_t pc) {
+void Ir_dbt::remove_block(emu::reg_t pc) {
+    auto entry = inst_cache_.find(pc);
+    if (!entry) return;
+
+    // The hit count is dropped as well, so the block has to become hot again to be recompiled.
+    if (!entry->block) {
+        inst_cache_.erase(pc);
+        return;
+    }
+
+    auto& block = *entry->block;
+    std::byte* begin = block.code.data();
+    std::byte* end = begin + block.code.size();
+    auto inside = [begin, end](const std::byte* ptr) { return ptr >= begin && ptr < end; };
+
+    // Restore trampolines in other blocks that jump into this block, so they return to the dispatcher. The epilogue
+    // follows the trampoline.
+    // mov rax, .trampoline => 48 B8 i64
+    // nop; nop => 90 90
+    for (auto trampoline: block.incoming) {
+        if (inside(trampoline)) continue;
+        util::write_as<uint16_t>(trampoline, 0xB848);
+        util::write_as<uint64_t>(trampoline + 2, reinterpret_cast<uint64_t>(trampoline));
+        util::write_as<uint16_t>(trampoline + 10, 0x9090);
+        links_.erase(trampoline);
+    }
+
+    // Links out of this block disappear with its code.
+    auto links_begin = links_.lower_bound(begin);
+    auto links_end = links_.lower_bound(end);
+    for (auto link = links_begin; link != links_end; ++link) {
+        if (link->second == pc) continue;
+        auto& incoming = inst_cache_.find(link->second)->block->incoming;
+        incoming.erase(std::remove(incoming.begin(), incoming.end(), link->first), incoming.end());
+    }
+    links_.erase(links_begin, links_end);
+
+    for (auto page: block.pages) {
+        auto& blocks = page_blocks_[page];
+        blocks.erase(std::remove(blocks.begin(), blocks.end(), pc), blocks.end());
+        if (blocks.empty()) page_blocks_.erase(page);
+    }
+
+    icache_.erase(pc);
+    if (inside(_code_ptr_to_patch)) _code_ptr_to_patch = nullptr;
+
+    code_blocks_.erase(begin);
+    inst_cache_.erase(pc);
+}
+
+void Ir_dbt::evict_generation() {
+    auto [begin, end] = code_cache_.next_generation();
+
+    // Blocks still being counted have no code and are kept.
+    std::vector<emu::reg_t> evicted;
+    for (auto iter = code_blocks_.lower_bound(begin); iter != code_blocks_.end() && iter->first < end; ++iter) {
+        evicted.push_back(iter->second);
+    }
+
+    for (auto pc: evicted) remove_block(pc);
+    return_stack_.clear();
+    code_cache_.advance();
+}
+
+void Ir_dbt::invalidate_code() {
+    for (auto [start, end]: emu::take_modified_code_ranges()) {
+        if (tier1_) tier1_->invalidate(start, end);
+
+        std::vector<emu::reg_t> invalidated;
+        for (
+            auto iter = page_blocks_.lower_bound(start &~ emu::page_mask);
+            iter != page_blocks_.end() && iter->first < end;
+            ++iter
+        ) {
+            invalidated.insert(invalidated.end(), iter->second.begin(), iter->second.end());
+        }
+
+        // A block spanning multiple pages may appear more than once, but it is only found the first time.
+        for (auto pc: invalidated) remove_block(pc);
+    }
+    return_stack_.clear();
+}
+
+ir::Graph Ir_dbt::decode(emu::reg_t pc, Ir_compilation& compilation) {
     riscv::Decoder decoder {pc};
-    riscv::Basic_block basic_block = decoder.decode_basic_block();
+    riscv::Basic_block basic_block;
+
+    if (!compilation.snapshot) {
+        basic_block = decoder.decode_basic_block();
+    } else {
+        // Guest code is copied before it is decoded, so a concurrent modification either shows up in the copy or makes
+        // it differ from the guest memory when the code is installed. The copy does not cross a page boundary unless
+        // the block does, as the next page might not be mapped.
+        std::vector<std::byte> bytes;
+        emu::reg_t end = std::min<emu::reg_t>(pc + 256, (pc &~ emu::page_mask) + emu::page_size);
+        while (true) {
+            bytes.resize(end - pc);
+            emu::copy_to_host(pc, bytes.data(), bytes.size());
+            basic_block = riscv::Decoder{pc}.decode_basic_block();
+            if (basic_block.end_pc <= end) break;
+            end = std::min<emu::reg_t>(
+                basic_block.end_pc + 256, ((basic_block.end_pc - 1) &~ emu::page_mask) + emu::page_size
+            );
+        }
+        bytes.resize(basic_block.end_pc - pc);
+        compilation.snapshots.emplace_back(pc, std::move(bytes));
+    }
+
+    auto& pages = compilation.pages;
+    for (emu::reg_t page = pc &~ emu::page_mask; page < basic_block.end_pc; page += emu::page_size) {
+        if (std::find(pages.begin(), pages.end(), page) == pages.end()) pages.push_back(page);
+    }
     ir::Graph graph = riscv::compile(basic_block);
 
     // Load/store elimination and LVN are required to allow inlining of auipc/jalr fused pair.
@@ -185,176 +330,555 @@ ir::Graph Ir_dbt::decode(emu::reg_t pc) {
     ir::analysis::Local_load_store_elimination{graph, block_analysis, 66}.run();
     ir::pass::Local_value_numbering{graph}.run();
 
+    uint64_t total = 0;
+    for (auto operand: graph.exit()->operands()) {
+        compilation.exit_sources[operand.node()] = pc;
+        ir::Value target_pc_value = ir::analysis::Block::get_tail_jmp_pc(operand, 64);
+        if (profile_ && target_pc_value && target_pc_value.is_const()) {
+            total += profile_->count(pc, target_pc_value.const_value());
+        }
+    }
+    compilation.exit_totals[pc] = total;
+
     return graph;
 }
 
-void Ir_dbt::compile(riscv::Context& context, emu::reg_t pc) {
-    const ptrdiff_t tag = (pc >> 1) & 4095;
-
-    // Check the flush flag here, if it is true then we need to flush cache entries.
-    if (UNLIKELY(_need_cache_flush)) {
-        inst_cache_.clear();
-        _need_cache_flush = false;
-        _code_ptr_to_patch = nullptr;
-    }
-
-    auto& block_ptr = inst_cache_[pc];
-    if (UNLIKELY(!block_ptr) || block_ptr->code.empty()) {
-        if (!block_ptr) block_ptr = std::make_unique<Ir_block>();
+void Ir_dbt::find_loops(Ir_compilation& compilation) {
+    // Explore basic blocks reachable from the region entry breadth-first, following constant successors that are not
+    // cold. Only instructions are decoded, no IR is built. The number of blocks is limited so sets of blocks fit in a
+    // 64-bit mask.
+    std::vector<emu::reg_t> blocks { compilation.pc };
+    std::unordered_map<emu::reg_t, size_t> index { {compilation.pc, 0} };
+    std::vector<std::vector<size_t>> successors;
+    std::vector<emu::reg_t> targets;
+
+    // Blocks ending with a call. Recursion is not treated as a loop, so their edges are never back edges.
+    uint64_t calls = 0;
+
+    for (size_t i = 0; i < blocks.size(); i++) {
+        successors.emplace_back();
+
+        riscv::Basic_block basic_block;
+        try {
+            basic_block = riscv::Decoder{blocks[i]}.decode_basic_block();
+        } catch (const Segv_exception&) {
+            continue;
+        }
 
-        if (block_ptr->num_hit < emu::state::compile_threshold) {
-            _code_ptr_to_patch = nullptr;
-            block_ptr->num_hit++;
-            riscv::Decoder decoder {pc};
-            riscv::Instruction inst;
-            do {
-                inst = decoder.decode_instruction();
-                context.pc += inst.length();
-                context.instret++;
-                try {
-                    riscv::step(&context, inst);
-                } catch(...) {
-                    // In case an exception happens, we need to move the pc before the instruction.
-                    context.pc -= inst.length();
-                    context.instret--;
-                    throw;
+        const riscv::Instruction& inst = basic_block.instructions.back();
+        emu::reg_t branch_target = basic_block.end_pc - inst.length() + inst.imm();
+        targets.clear();
+        switch (inst.opcode()) {
+            case riscv::Opcode::beq:
+            case riscv::Opcode::bne:
+            case riscv::Opcode::blt:
+            case riscv::Opcode::bge:
+            case riscv::Opcode::bltu:
+            case riscv::Opcode::bgeu: {
+                targets.push_back(basic_block.end_pc);
+                targets.push_back(branch_target);
+
+                // Drop the cold side, as it is not going to be part of the region anyway.
+                if (profile_) {
+                    uint64_t not_taken = profile_->count(blocks[i], basic_block.end_pc);
+                    uint64_t taken = profile_->count(blocks[i], branch_target);
+                    if (taken * cold_edge_ratio < not_taken) targets.pop_back();
+                    else if (not_taken * cold_edge_ratio < taken) targets.erase(targets.begin());
                 }
-            } while (!decoder.can_change_control_flow(inst));
-            return;
+                break;
+            }
+            case riscv::Opcode::jal:
+                targets.push_back(branch_target);
+                if (inst.rd() != 0) calls |= uint64_t(1) << i;
+                break;
+            case riscv::Opcode::jalr: break;
+            default: targets.push_back(basic_block.end_pc); break;
         }
 
-        auto start = emu::state::monitor_performance ?
-            std::chrono::high_resolution_clock::now().time_since_epoch().count() : 0;
+        for (auto target: targets) {
+            auto iter = index.find(target);
+            if (iter == index.end()) {
+                if (blocks.size() == 64) continue;
+                iter = index.emplace(target, blocks.size()).first;
+                blocks.push_back(target);
+            }
+            successors[i].push_back(iter->second);
+        }
+    }
 
-        ir::Graph graph = decode(pc);
-        block_ptr->code.reserve(4096);
+    // Iterative dominator computation over bit sets. The entry has no predecessors within the explored graph that
+    // matter, as it only dominates itself.
+    size_t count = blocks.size();
+    std::vector<uint64_t> dominators(count, ~uint64_t(0));
+    dominators[0] = 1;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t i = 1; i < count; i++) {
+            uint64_t dom = ~uint64_t(0);
+            for (size_t pred = 0; pred < count; pred++) {
+                for (auto succ: successors[pred]) {
+                    if (succ == i) dom &= dominators[pred];
+                }
+            }
+            dom |= uint64_t(1) << i;
+            if (dom != dominators[i]) {
+                dominators[i] = dom;
+                changed = true;
+            }
+        }
+    }
 
-        // A map between emulated pc and entry point in the graph.
-        std::unordered_map<emu::reg_t, ir::Node*> block_map;
-        block_map[pc] = *graph.entry()->value(0).references().begin();
+    // An edge to a dominator is a back edge. The natural loop consists of the header and all blocks that reach the
+    // back edge without going through the header.
+    for (size_t tail = 0; tail < count; tail++) {
+        if (calls & (uint64_t(1) << tail)) continue;
+        for (auto header: successors[tail]) {
+            if (!(dominators[tail] & (uint64_t(1) << header))) continue;
+
+            uint64_t body = (uint64_t(1) << header) | (uint64_t(1) << tail);
+            std::vector<size_t> stack { tail };
+            while (!stack.empty()) {
+                size_t block = stack.back();
+                stack.pop_back();
+                if (block == header) continue;
+                for (size_t pred = 0; pred < count; pred++) {
+                    if (body & (uint64_t(1) << pred)) continue;
+                    for (auto succ: successors[pred]) {
+                        if (succ != block) continue;
+                        body |= uint64_t(1) << pred;
+                        stack.push_back(pred);
+                        break;
+                    }
+                }
+            }
 
-        int counter = 0;
-        size_t operand_count = graph.exit()->operand_count();
+            compilation.loop_headers.insert(blocks[header]);
+            for (size_t i = 0; i < count; i++) {
+                if (body & (uint64_t(1) << i)) compilation.loop_blocks.insert(blocks[i]);
+            }
+        }
+    }
+}
 
-        for (size_t i = 0; i < operand_count; i++) {
+std::unique_ptr<Ir_compilation> Ir_dbt::build(emu::reg_t pc, bool snapshot) {
+    auto start = emu::state::monitor_performance ?
+        std::chrono::high_resolution_clock::now().time_since_epoch().count() : 0;
+
+    auto compilation = std::make_unique<Ir_compilation>();
+    compilation->pc = pc;
+    compilation->snapshot = snapshot;
+    ir::Graph& graph = compilation->graph;
+    graph = decode(pc, *compilation);
+
+    // A map between emulated pc and entry point in the graph.
+    std::unordered_map<emu::reg_t, ir::Node*> block_map;
+    block_map[pc] = *graph.entry()->value(0).references().begin();
+
+    // Grow the region one block at a time. If the region starts at a loop header, blocks of the loop are inlined first,
+    // so the region contains the complete loop body and back edges stay within the compiled code. Otherwise, without a
+    // profile, tail jumps are inlined breadth-first. With a profile, the hottest successor is inlined first and
+    // successors reached by a cold edge are left as side exits, so the region follows the hot path. Successors of
+    // blocks without any recorded executions are treated as neither.
+    find_loops(*compilation);
+    bool has_loop = false;
+    int counter = 0;
+    while (true) {
+        ir::Value best;
+        emu::reg_t best_pc = 0;
+        bool best_in_loop = false;
+        uint32_t best_count = 0;
+
+        for (size_t i = 0; i < graph.exit()->operand_count(); i++) {
             auto operand = graph.exit()->operand(i);
             ir::Value target_pc_value = ir::analysis::Block::get_tail_jmp_pc(operand, 64);
+            if (!target_pc_value || !target_pc_value.is_const()) continue;
 
-            // We can inline tail jump.
-            if (target_pc_value && target_pc_value.is_const()) {
-                auto target_pc = target_pc_value.const_value();
-                if (!target_pc) continue;
+            auto target_pc = target_pc_value.const_value();
+            if (!target_pc) continue;
 
-                auto block = block_map[target_pc];
+            auto block = block_map[target_pc];
+            if (block) {
 
-                if (block) {
+                // Add a new edge to the block, and remove the old edge to exit node.
+                graph.exit()->operand_delete(operand);
+                block->operand_add(operand);
+                if (target_pc == pc && compilation->loop_headers.count(pc)) has_loop = true;
+                i--;
+                continue;
+            }
 
-                    // Add a new edge to the block, and remove the old edge to exit node.
-                    graph.exit()->operand_delete(operand);
-                    block->operand_add(operand);
+            // Loops are only compiled as part of the region rooted at their header, so other loop headers are left as
+            // exits. This way the back edge of a loop always jumps to the start of its region.
+            if (compilation->loop_headers.count(target_pc)) continue;
 
-                    // Update constraints
-                    i--;
-                    operand_count--;
+            uint32_t count = 0;
+            if (profile_) {
+                emu::reg_t source = compilation->exit_sources[operand.node()];
+                count = profile_->count(source, target_pc);
+                uint64_t total = compilation->exit_totals[source];
+                if (total != 0 && uint64_t{count} * cold_edge_ratio < total) continue;
+            }
 
-                } else if (counter < emu::state::inline_limit) {
+            bool in_loop = compilation->loop_blocks.count(target_pc) != 0;
+            if (!best || (in_loop && !best_in_loop) || (in_loop == best_in_loop && count > best_count)) {
+                best = operand;
+                best_pc = target_pc;
+                best_in_loop = in_loop;
+                best_count = count;
+            }
+        }
 
-                    // To avoid spending too much time inlining all possible branches, we set an upper limit.
+        // To avoid spending too much time inlining all possible branches, we set an upper limit.
+        if (!best || counter >= emu::state::inline_limit) break;
 
-                    // Decode and clone the graph of the block to be inlined.
-                    ir::Graph graph_to_inline = decode(target_pc);
+        // Decode and clone the graph of the block to be inlined.
+        ir::Graph graph_to_inline = decode(best_pc, *compilation);
 
-                    // Store the entry point of the inlined graph.
-                    block_map[target_pc] = *graph_to_inline.entry()->value(0).references().begin();
+        // Store the entry point of the inlined graph.
+        block_map[best_pc] = *graph_to_inline.entry()->value(0).references().begin();
 
-                    if (emu::state::disassemble) {
-                        util::log("inline {:x} to {:x}\n", target_pc, pc);
-                    }
+        if (emu::state::disassemble) {
+            util::log("inline {:x} to {:x}\n", best_pc, pc);
+        }
 
-                    // Inline the graph. Note that the iterator is invalidated so we need to break.
-                    graph.inline_graph(operand, std::move(graph_to_inline));
+        graph.inline_graph(best, std::move(graph_to_inline));
+        counter++;
+    }
 
-                    // Update constraints
-                    i--;
-                    operand_count = graph.exit()->operand_count();
-                    counter++;
-                }
-            }
-        }
+    // Insert keepalive edges and merge blocks without interesting control flow.
+    auto& block_analysis = compilation->block_analysis.emplace(graph);
+    block_analysis.update_keepalive();
+    block_analysis.simplify_graph();
+
+    if (emu::state::disassemble) {
+        util::log("IR for {:x}\n", pc);
+        x86::backend::Dot_printer{}.run(graph);
+    }
 
-        // Insert keepalive edges and merge blocks without interesting control flow.
-        ir::analysis::Block block_analysis{graph};
-        block_analysis.update_keepalive();
+    // A loop back to the start of the region needs a preheader. Load/store elimination can then keep guest registers in
+    // PHI nodes around the loop instead of loading them in every iteration, and the scheduler can place loop-invariant
+    // nodes there. The block is merged away again if nothing is placed there.
+    auto split_preheader = [&]() -> ir::Node* {
+        if (ir::analysis::Block::get_target(graph.entry()->value(0))->operand_count() == 1) return nullptr;
+        return block_analysis.split_edge(graph.entry()->value(0));
+    };
+    auto preheader = split_preheader();
+
+    {
+        // We are making this regional, as simplify graph will break the dominance tree, so we need to reconstruct.
+        // TODO: Maybe find a way to incrementally update the tree when the control is simplified?
+        ir::analysis::Dominance dom(graph, block_analysis);
+        // Guest registers carried around a loop are kept in host registers through PHI nodes.
+        ir::analysis::Load_store_elimination elim{graph, block_analysis, dom, 66, emu::state::enable_phi || has_loop};
+        if (preheader) elim.preload(preheader);
+        elim.eliminate_load();
+        elim.eliminate_store();
+
+        // Equal constants and expressions need to be the same node before PHI nodes merging them can be numbered.
+        ir::pass::Local_value_numbering{graph}.run();
+        ir::analysis::Global_value_numbering{graph, block_analysis, dom}.run();
+
+        // With addresses numbered, guest memory accesses from the same base can be disambiguated.
+        ir::analysis::Memory_load_store_elimination memory_elim{graph, block_analysis};
+        memory_elim.eliminate_load();
+        memory_elim.eliminate_store();
+
+        // Fold branches on known values, and let the blocks left behind be merged.
+        ir::analysis::Constant_propagation{graph, block_analysis}.run();
         block_analysis.simplify_graph();
+    }
 
-        if (emu::state::disassemble) {
-            util::log("IR for {:x}\n", pc);
-            x86::backend::Dot_printer{}.run(graph);
-        }
+    {
+        // PHI nodes collapsed by removed edges can leave PHI nodes around loops merging only themselves with a single
+        // value. Number them again over the new dominator tree.
+        ir::analysis::Dominance dom(graph, block_analysis);
+        ir::analysis::Global_value_numbering{graph, block_analysis, dom}.run();
+    }
 
-        {
-            // We are making this regional, as simplify graph will break the dominance tree, so we need to reconstruct.
-            // TODO: Maybe find a way to incrementally update the tree when the control is simplified?
-            ir::analysis::Dominance dom(graph, block_analysis);
-            ir::analysis::Load_store_elimination elim{graph, block_analysis, dom, 66};
-            elim.eliminate_load();
-            elim.eliminate_store();
-            block_analysis.simplify_graph();
-        }
+    ir::pass::Local_value_numbering{graph}.run();
+
+    // Blocks are no longer merged from here, so additions to instret can be placed along the final control flow.
+    ir::analysis::Instret_placement{graph, block_analysis}.run();
 
+    // Dump IR if --disassemble is used.
+    if (emu::state::disassemble) {
+        util::log("IR for {:x}-opt\n", pc);
+        x86::backend::Dot_printer{}.run(graph);
+    }
+
+    // Lowering and target-specific lowering. Currently lowering is only needed if no_direct_memory_access is on.
+    if (emu::state::no_direct_memory_access) {
+        ir::pass::Lowering{}.run(graph);
         ir::pass::Local_value_numbering{graph}.run();
+    }
+    x86::backend::Lowering{graph}.run();
 
-        // Dump IR if --disassemble is used.
+    split_preheader();
+
+    // This garbage collection is required for Value::references to correctly reflect number of users.
+    graph.garbage_collect();
+
+    auto& dom = compilation->dom.emplace(graph, block_analysis);
+
+    // Reorder basic blocks before feeding it to the backend.
+    block_analysis.reorder(dom);
+
+    auto& scheduler = compilation->scheduler.emplace(graph, block_analysis, dom);
+    scheduler.schedule();
+    auto& regalloc = compilation->regalloc.emplace(graph, block_analysis, scheduler);
+    regalloc.allocate();
+
+    if (emu::state::monitor_performance) {
+        auto end = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        compilation->time = end - start;
+    }
+
+    return compilation;
+}
+
+bool Ir_dbt::install(Ir_compilation& compilation) {
+    const emu::reg_t pc = compilation.pc;
+    ASSERT(!inst_cache_[pc].code);
+    auto block_ptr = std::make_unique<Ir_block>(code_cache_);
+
+    auto start = emu::state::monitor_performance ?
+        std::chrono::high_resolution_clock::now().time_since_epoch().count() : 0;
+
+    // Write-protect the guest pages first, so modifications after the snapshots are compared are detected.
+    for (auto page: compilation.pages) {
+        emu::track_code_page(page);
+    }
+
+    try {
+        std::vector<std::byte> bytes;
+        for (auto& [address, snapshot]: compilation.snapshots) {
+            bytes.resize(snapshot.size());
+            emu::copy_to_host(address, bytes.data(), bytes.size());
+            if (bytes != snapshot) return false;
+        }
+    } catch (const Segv_exception&) {
+        return false;
+    }
+
+    try {
+        block_ptr->code.reserve(4096);
         if (emu::state::disassemble) {
-            util::log("IR for {:x}-opt\n", pc);
-            x86::backend::Dot_printer{}.run(graph);
             util::log("Translating {:x} to {:x}\n", pc, reinterpret_cast<uintptr_t>(block_ptr->code.data()));
         }
+        x86::backend::Code_generator generator {
+            block_ptr->code, compilation.graph, *compilation.block_analysis, *compilation.scheduler,
+            *compilation.regalloc, icache_, &return_stack_
+        };
+        generator.run();
+        block_ptr->memory_access_sites = std::move(generator.memory_access_sites());
+    } catch (const std::bad_alloc&) {
+        // The current generation is full. Evict the oldest one so the caller can retry there, unless the block does
+        // not fit even in an empty generation. The partially emitted code is discarded but the hit count is kept.
+        block_ptr.reset();
+        if (code_cache_.generation_empty()) throw;
+        evict_generation();
+        return false;
+    }
+
+    for (auto page: compilation.pages) {
+        page_blocks_[page].push_back(pc);
+    }
+    block_ptr->pages = std::move(compilation.pages);
+    code_blocks_[block_ptr->code.data()] = pc;
+
+    // The lower-tier block is dropped, which unlinks its callers so they come to the dispatcher instead.
+    if (tier1_) tier1_->retire(pc);
+
+    // Update tag to reflect newly compiled code.
+    icache_.insert(pc, block_ptr->code.data());
+
+    auto& entry = inst_cache_[pc];
+    entry.code = block_ptr->code.data();
+    entry.block = std::move(block_ptr);
 
-        // Lowering and target-specific lowering. Currently lowering is only needed if no_direct_memory_access is on.
-        if (emu::state::no_direct_memory_access) {
-            ir::pass::Lowering{}.run(graph);
-            ir::pass::Local_value_numbering{graph}.run();
+    if (emu::state::monitor_performance) {
+        auto end = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+        total_compilation_time += compilation.time + end - start;
+        total_block_compiled++;
+    }
+    return true;
+}
+
+void Ir_dbt::request(Ir_entry& entry, emu::reg_t pc) {
+    std::lock_guard<std::mutex> lock {queue_mutex_};
+
+    // Blocks requested again while waiting are considered hotter, so they are compiled first.
+    if (entry.requested) {
+        auto iter = requests_.find(pc);
+        if (iter != requests_.end()) iter->second++;
+        return;
+    }
+
+    entry.requested = true;
+    requests_[pc] = 1;
+    queue_cv_.notify_one();
+}
+
+void Ir_dbt::work() {
+    std::unique_lock<std::mutex> lock {queue_mutex_};
+    while (true) {
+        queue_cv_.wait(lock, [this]() { return stopping_ || !requests_.empty(); });
+        if (stopping_) return;
+
+        auto hottest = std::max_element(requests_.begin(), requests_.end(), [](auto& a, auto& b) {
+            return a.second < b.second;
+        });
+        emu::reg_t pc = hottest->first;
+        requests_.erase(hottest);
+        lock.unlock();
+
+        // Failures, e.g. guest code being unmapped while it is decoded, are discarded. The pc is requested again if it
+        // is still hot.
+        std::unique_ptr<Ir_compilation> compilation;
+        try {
+            compilation = build(pc, true);
+        } catch (...) {
         }
-        x86::backend::Lowering{graph}.run();
 
-        // This garbage collection is required for Value::references to correctly reflect number of users.
-        graph.garbage_collect();
+        lock.lock();
+        finished_.push_back(compilation ? std::move(compilation) : std::make_unique<Ir_compilation>());
+        finished_.back()->pc = pc;
+        has_finished_.store(true, std::memory_order_release);
+    }
+}
 
-        ir::analysis::Dominance dom{graph, block_analysis};
+void Ir_dbt::install_finished() {
+    std::vector<std::unique_ptr<Ir_compilation>> finished;
+    {
+        std::lock_guard<std::mutex> lock {queue_mutex_};
+        finished.swap(finished_);
+        has_finished_.store(false, std::memory_order_relaxed);
+    }
 
-        // Reorder basic blocks before feeding it to the backend.
-        block_analysis.reorder(dom);
+    for (auto& compilation: finished) {
+        auto entry = inst_cache_.find(compilation->pc);
 
-        ir::analysis::Scheduler scheduler{graph, block_analysis, dom};
-        scheduler.schedule();
-        x86::backend::Register_allocator regalloc{graph, block_analysis, scheduler};
-        regalloc.allocate();
-        x86::backend::Code_generator{block_ptr->code, graph, block_analysis, scheduler, regalloc}.run();
-        generate_eh_frame(*block_ptr, regalloc.get_stack_size());
+        // The block may have been removed while it was compiled, in which case it is requested again when it becomes
+        // hot. A removed block might also have been requested and compiled again.
+        if (!entry || !entry->requested || entry->code) continue;
+        entry->requested = false;
+        if (compilation->regalloc) install(*compilation);
+    }
+}
+
+void Ir_dbt::compile(riscv::Context& context, emu::reg_t pc) {
+    // Entries may move when the cache is modified, so this pointer is only used until compilation.
+    auto entry = &inst_cache_[pc];
+    if (UNLIKELY(!entry->code)) {
+
+        // With background compilation, hot blocks keep running in the lower tier until their code is installed.
+        bool hot = tier1_ ? tier1_->is_hot(pc) : entry->num_hit >= emu::state::compile_threshold;
+        if (hot && !workers_.empty()) {
+            request(*entry, pc);
+            hot = false;
+        }
+
+        if (!hot) {
+            _code_ptr_to_patch = nullptr;
+
+            // Run lukewarm blocks with the lower tier, which counts executions of each block and returns here once it
+            // becomes hot.
+            if (tier1_) {
+                tier1_->run(context);
+                return;
+            }
 
-        if (emu::state::monitor_performance) {
-            auto end = std::chrono::high_resolution_clock::now().time_since_epoch().count();
-            total_compilation_time += end - start;
-            total_block_compiled++;
+            if (entry->num_hit < emu::state::compile_threshold) entry->num_hit++;
+            riscv::Decoder decoder {pc};
+            riscv::Instruction inst;
+            do {
+                inst = decoder.decode_instruction();
+                context.pc += inst.length();
+                context.instret++;
+                try {
+                    riscv::step(&context, inst);
+                } catch(...) {
+                    // In case an exception happens, we need to move the pc before the instruction.
+                    context.pc -= inst.length();
+                    context.instret--;
+                    throw;
+                }
+            } while (!decoder.can_change_control_flow(inst));
+            if (profile_) profile_->record(pc, context.pc);
+            return;
         }
+
+        // Compilation is repeated if the code cache has to evict a generation first.
+        auto compilation = build(pc, false);
+        while (!install(*compilation)) compilation = build(pc, false);
+        entry = inst_cache_.find(pc);
     }
 
     // Update tag to reflect newly compiled code.
-    icache_[tag] = block_ptr->code.data();
-    icache_tag_[tag] = pc;
+    icache_.insert(pc, entry->code);
 
     // Run the newly compiled (or loaded from cache) code.
-    auto func = reinterpret_cast<Compiled_function>(icache_[tag]);
+    auto func = reinterpret_cast<Compiled_function>(entry->code);
     ASSERT(func);
-    if (_code_ptr_to_patch) patch_trampoline(func);
+    if (_code_ptr_to_patch) patch_trampoline(pc, func);
+    if (tier1_) tier1_->cancel_patch();
     _code_ptr_to_patch = func(context);
 }
 
 void Ir_dbt::flush_cache() {
-    for (int i = 0; i < 4096; i++)
-        icache_tag_[i] = 0;
+    // Writes to other code pages are detected by write protection, so only shared pages need to be invalidated.
+    emu::invalidate_shared_code_pages();
+
+    if (emu::code_modified) code_modified();
+}
+
+void Ir_dbt::code_modified() {
+    // The invalidation happens in the dispatcher. Blocks containing fence.i or ecall exit indirectly, so clearing the
+    // hot cache and the return stack makes sure they do return to the dispatcher.
+    icache_.clear();
+    return_stack_.clear();
+}
+
+void Ir_dbt::restore_fault_state(std::byte* host_pc, const greg_t* registers) noexcept {
+    auto& context = *reinterpret_cast<riscv::Context*>(registers[REG_RBP]);
+
+    // Indices of host registers in the saved signal context, in encoding order.
+    static constexpr int greg_index[] = {
+        REG_RAX, REG_RCX, REG_RDX, REG_RBX, REG_RSP, REG_RBP, REG_RSI, REG_RDI,
+        REG_R8, REG_R9, REG_R10, REG_R11, REG_R12, REG_R13, REG_R14, REG_R15
+    };
+    uint64_t pinned_values[std::size(x86::backend::pinned_registers)];
+    for (size_t i = 0; i < x86::backend::Code_generator::pinned_register_count(); i++) {
+        auto reg = x86::backend::pinned_registers[i].second;
+        pinned_values[i] = registers[greg_index[static_cast<uint8_t>(reg) & 0xF]];
+    }
+    restore_guest_state(host_pc, context, pinned_values);
+}
+
+void Ir_dbt::restore_guest_state(
+    std::byte* host_pc, riscv::Context& context, const uint64_t* pinned_values
+) noexcept {
+    auto block_iter = code_blocks_.upper_bound(host_pc);
+    if (block_iter == code_blocks_.begin()) return;
+    auto& block = *inst_cache_.find(std::prev(block_iter)->second)->block;
+
+    // Faults elsewhere, e.g. in helper functions, happen after the context is updated by the frontend.
+    auto& sites = block.memory_access_sites;
+    uint32_t host_offset = host_pc - block.code.data();
+    auto site = std::lower_bound(
+        sites.begin(), sites.end(), host_offset,
+        [](const x86::backend::Memory_access_site& site, uint32_t offset) { return site.host_offset < offset; }
+    );
+    if (site == sites.end() || site->host_offset != host_offset) return;
+
+    // Pinned registers hold the current values, including the instructions counted so far.
+    for (size_t i = 0; i < x86::backend::Code_generator::pinned_register_count(); i++) {
+        reinterpret_cast<emu::reg_t*>(&context)[x86::backend::pinned_registers[i].first] = pinned_values[i];
+    }
 
-    // As all cache tags are cleared, next time method compile will be called. We can check the flag there.
-    _need_cache_flush = true;
+    // The store of pc is only done at the end of each basic block, and with strict exceptions it cannot be delayed past
+    // a memory access. The site also records the instructions retired but not yet counted, which completes instret.
+    context.pc = site->pc;
+    context.instret += site->instret;
 }
@@ -20,6 +20,7 @@
 #include "riscv/disassembler.h"
 #include "riscv/instruction.h"
 #include "riscv/opcode.h"
+#include "util/code_buffer.h"
 #include "util/format.h"
 
 static const char *usage_string = "Usage: {} [options] program [arguments...]\n\
@@ -31,15 +32,36 @@ Options:\n\
   --engine=interpreter  Use interpreter instead of dynamic binary translator.\n\
   --engine=dbt          Use simple binary translator instead of IR-based\n\
                         optimising binary translator.\n\
-  --with-instret        Enable precise instret updating in binary translated\n\
-                        code.\n\
+  --with-instret        Enable precise instret updating in code of the simple\n\
+                        binary translator. The IR-based binary translator\n\
+                        always keeps instret precise.\n\
   --strict-exception    Enable strict enforcement of excecution correctness in\n\
                         case of segmentation fault.\n\
+  --fault-tables        Recover from faults in translated code by restoring guest\n\
+                        state from side tables and jumping back to the\n\
+                        dispatcher, instead of unwinding through the code.\n\
   --enable-phi          Allow load elimination to emit PHI nodes.\n\
+  --pin-registers       Keep sp, ra, s0 and a0 in host registers across\n\
+                        blocks translated by the IR-based binary translator.\n\
+  --global-regalloc     Allocate registers over a whole region instead of each\n\
+                        block alone. Values stay in registers across blocks,\n\
+                        the value used furthest away is spilled, and differing\n\
+                        locations are reconciled by moves on control edges.\n\
   --region-limit=<n>    Number of basic blocks that can be included in a single\n\
                         compilation region by the IR-based binary translator.\n\
   --compile-threshold=<n> Number of execution required for a block to be\n\
                         considered by the IR-based binary translator.\n\
+  --compile-threads=<n> Number of threads compiling hot blocks in the background\n\
+                        while they keep running in the lower tier.\n\
+  --tiered              Run blocks below the compile threshold with the simple\n\
+                        binary translator instead of the interpreter.\n\
+  --code-cache-limit=<n> Size of the translated code cache in bytes. Suffixes K,\n\
+                        M and G are accepted. The oldest code is evicted when\n\
+                        the cache is full. At least 64K.\n\
+  --icache-size=<n>     Number of entries in the dispatch cache. Power of two,\n\
+                        4096 by default.\n\
+  --icache-ways=<n>     Associativity of the dispatch cache. Power of two no\n\
+                        larger than the size, 4 by default.\n\
   --monitor-performance Display metrics about performance in compilation phase.\n\
   --sysroot             Change the sysroot to a non-default value.\n\
   --help                Display this help message.\n\
@@ -49,6 +71,16 @@ extern "C" {
     extern char **environ;
 }
 
+// Run guest code until it exits. Faults recovered from without unwinding continue here, and are reported the same way
+// as those that are thrown.
+template<typename Executor_type>
+[[noreturn]] static void run(Executor_type& executor, riscv::Context& context) {
+    if (int sig = sigsetjmp(fault_recovery_point, 1)) throw Segv_exception {sig};
+    while (true) {
+        executor.step(context);
+    }
+}
+
 int main(int argc, const char **argv) {
 
     setup_fault_handler();
@@ -83,12 +115,51 @@ int main(int argc, const char **argv) {
             emu::state::no_instret = false;
         } else if (strcmp(arg, "--strict-exception") == 0) {
             emu::state::strict_exception = true;
+        } else if (strcmp(arg, "--fault-tables") == 0) {
+            emu::state::fault_tables = true;
         } else if (strcmp(arg, "--enable-phi") == 0) {
             emu::state::enable_phi = true;
+        } else if (strcmp(arg, "--pin-registers") == 0) {
+            emu::state::pin_registers = true;
+        } else if (strcmp(arg, "--global-regalloc") == 0) {
+            emu::state::global_regalloc = true;
         } else if (strncmp(arg, "--region-limit=", strlen("--region-limit=")) == 0) {
             emu::state::inline_limit = atoi(arg + strlen("--region-limit=")) - 1;
         } else if (strncmp(arg, "--compile-threshold=", strlen("--compile-threshold=")) == 0) {
             emu::state::compile_threshold = atoi(arg + strlen("--compile-threshold="));
+        } else if (strncmp(arg, "--compile-threads=", strlen("--compile-threads=")) == 0) {
+            emu::state::compile_threads = atoi(arg + strlen("--compile-threads="));
+        } else if (strcmp(arg, "--tiered") == 0) {
+            emu::state::tiered = true;
+        } else if (strncmp(arg, "--code-cache-limit=", strlen("--code-cache-limit=")) == 0) {
+            char *end;
+            size_t limit = strtoull(arg + strlen("--code-cache-limit="), &end, 10);
+            switch (*end) {
+                case 'G': case 'g': limit <<= 10; [[fallthrough]];
+                case 'M': case 'm': limit <<= 10; [[fallthrough]];
+                case 'K': case 'k': limit <<= 10; end++; break;
+            }
+            if (*end != 0 || limit < util::Code_cache::min_limit) {
+                util::error("{}: invalid code cache limit '{}'\n", argv[0], arg);
+                return 1;
+            }
+            emu::state::code_cache_limit = limit;
+        } else if (strncmp(arg, "--icache-size=", strlen("--icache-size=")) == 0) {
+            char *end;
+            size_t size = strtoull(arg + strlen("--icache-size="), &end, 10);
+            if (*end != 0 || size == 0 || (size & (size - 1)) != 0 || size > (1 << 24)) {
+                util::error("{}: invalid dispatch cache size '{}'\n", argv[0], arg);
+                return 1;
+            }
+            emu::state::icache_size = size;
+        } else if (strncmp(arg, "--icache-ways=", strlen("--icache-ways=")) == 0) {
+            char *end;
+            size_t ways = strtoull(arg + strlen("--icache-ways="), &end, 10);
+            if (*end != 0 || ways == 0 || (ways & (ways - 1)) != 0) {
+                util::error("{}: invalid dispatch cache associativity '{}'\n", argv[0], arg);
+                return 1;
+            }
+            emu::state::icache_ways = ways;
         } else if (strcmp(arg, "--monitor-performance") == 0) {
             emu::state::monitor_performance = true;
         } else if (strncmp(arg, "--sysroot=", strlen("--sysroot=")) == 0) {
@@ -102,6 +173,11 @@ int main(int argc, const char **argv) {
         }
     }
 
+    if (emu::state::icache_ways > emu::state::icache_size) {
+        util::error("{}: dispatch cache associativity exceeds its size\n", argv[0]);
+        return 1;
+    }
+
     // The next argument is the path to the executable.
     if (arg_index == argc) {
         util::error(usage_string, argv[0]);
@@ -213,21 +289,15 @@ int main(int argc, const char **argv) {
         if (use_ir) {
             Ir_dbt executor;
             context.executor = &executor;
-            while (true) {
-                executor.step(context);
-            }
+            run(executor, context);
         } else if (use_dbt) {
             Dbt_runtime executor;
             context.executor = &executor;
-            while (true) {
-                executor.step(context);
-            }
+            run(executor, context);
         } else {
             Interpreter executor;
             context.executor = &executor;
-            while (true) {
-                executor.step(context);
-            }
+            run(executor, context);
         }
     } catch (emu::Exit_control& ex) {
         return ex.exit_code;
@@ -3,16 +3,52 @@
 #include <cstring>
 #include <limits>
 
+#include "emu/mmu.h"
+#include "emu/state.h"
 #include "main/signal.h"
 #include "util/memory.h"
 #include "x86/decoder.h"
 #include "x86/opcode.h"
 
+sigjmp_buf fault_recovery_point;
+
 namespace {
 
-void handle_fault(int sig) {
+// Code caches of live translators. A fixed-size array is used, as it is read from the signal handler.
+struct Translated_code {
+    std::byte* begin;
+    std::byte* end;
+    Fault_recoverable* owner;
+};
+
+constexpr size_t max_translated_code = 4;
+Translated_code translated_code[max_translated_code];
+size_t translated_code_count = 0;
+
+void handle_fault(int sig, siginfo_t* info, void* context) {
     ASSERT(sig == SIGSEGV || sig == SIGBUS);
 
+    // A write to a page translated code is generated from. Once the page is made writable the write can be restarted.
+    // Read faults are not considered, as they may come from compilation threads which must not touch the page list.
+    auto ucontext = reinterpret_cast<ucontext_t*>(context);
+    if (
+        sig == SIGSEGV && (ucontext->uc_mcontext.gregs[REG_ERR] & 2) &&
+        emu::handle_code_write_fault(reinterpret_cast<emu::reg_t>(info->si_addr))
+    ) {
+        return;
+    }
+
+    // A fault in translated code. The guest state is restored without unwinding, and execution continues in the
+    // dispatcher loop with the signal mask saved there.
+    if (emu::state::fault_tables) {
+        auto rip = reinterpret_cast<std::byte*>(ucontext->uc_mcontext.gregs[REG_RIP]);
+        for (size_t i = 0; i < translated_code_count; i++) {
+            if (rip < translated_code[i].begin || rip >= translated_code[i].end) continue;
+            translated_code[i].owner->restore_fault_state(rip, ucontext->uc_mcontext.gregs);
+            siglongjmp(fault_recovery_point, sig);
+        }
+    }
+
     sigset_t x;
     sigemptyset(&x);
     sigaddset(&x, sig);
@@ -99,11 +135,25 @@ void handle_fpe(int sig, siginfo_t*, void* context) {
 
 }
 
+void add_translated_code(std::byte* begin, size_t size, Fault_recoverable* owner) {
+    ASSERT(translated_code_count < max_translated_code);
+    translated_code[translated_code_count++] = { begin, begin + size, owner };
+}
+
+void remove_translated_code(Fault_recoverable* owner) {
+    for (size_t i = 0; i < translated_code_count; i++) {
+        if (translated_code[i].owner != owner) continue;
+        translated_code[i] = translated_code[--translated_code_count];
+        return;
+    }
+}
+
 void setup_fault_handler() {
     struct sigaction act;
 
     memset (&act, 0, sizeof(act));
-    act.sa_handler = handle_fault;
+    act.sa_sigaction = handle_fault;
+    act.sa_flags = SA_SIGINFO;
     sigaction(SIGSEGV, &act, NULL);
     sigaction(SIGBUS, &act, NULL);
 
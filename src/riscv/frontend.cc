@@ -28,12 +28,17 @@ struct Frontend {
 
     ir::Value emit_load_register(ir::Type type, uint16_t reg);
     void emit_store_register(uint16_t reg, ir::Value value, bool sext = true);
+    void emit_push_return(ir::Value return_pc_value);
 
     // If some instruction has the possibility to throw, for correctness we need to update pc and instret to
     // correct value before the instruction.
     void update_pc();
     void update_instret();
 
+    // Memory accesses record pc and instret instead, from which they are restored if the access faults in translated
+    // code. Helper functions fault outside translated code though, so the context needs to be updated before them.
+    void prepare_memory_access();
+
     void emit_load(Instruction inst, ir::Type type, bool sext);
     void emit_store(Instruction inst, ir::Type type);
     void emit_alui(Instruction inst, uint16_t opcode, bool w);
@@ -60,6 +65,13 @@ ir::Value Frontend::emit_load_register(ir::Type type, uint16_t reg) {
     return ret;
 }
 
+void Frontend::emit_push_return(ir::Value return_pc_value) {
+    auto sp_value = emit_load_register(ir::Type::i64, 2);
+    last_memory = builder.create(
+        ir::Opcode::push_return, {ir::Type::memory}, {last_memory, sp_value, return_pc_value}
+    )->value(0);
+}
+
 void Frontend::emit_store_register(uint16_t reg, ir::Value value, bool sext) {
     ASSERT(reg != 0);
     if (value.type() != ir::Type::i64) value = builder.cast(ir::Type::i64, sext, value);
@@ -73,38 +85,37 @@ void Frontend::update_pc() {
 }
 
 void Frontend::update_instret() {
-    // Update instret
-    if (!emu::state::no_instret) {
-        ir::Value instret_value;
-        std::tie(last_memory, instret_value) = builder.load_register(last_memory, 65);
-        auto instret_offset_value = builder.constant(ir::Type::i64, instret);
-        auto new_instret_value = builder.arithmetic(ir::Opcode::add, instret_value, instret_offset_value);
-        last_memory = builder.store_register(last_memory, 65, new_instret_value);
-        instret = 0;
+    // Update instret. Where the addition actually happens is decided by Instret_placement.
+    last_memory = builder.add_instret(last_memory, instret);
+    instret = 0;
+}
+
+void Frontend::prepare_memory_access() {
+    if (emu::state::no_direct_memory_access) {
+        update_pc();
+        update_instret();
     }
 }
 
 void Frontend::emit_load(Instruction inst, ir::Type type, bool sext) {
-    update_pc();
-    update_instret();
+    prepare_memory_access();
 
     auto rs1_value = emit_load_register(ir::Type::i64, inst.rs1());
     auto imm_value = builder.constant(ir::Type::i64, inst.imm());
     auto address = builder.arithmetic(ir::Opcode::add, rs1_value, imm_value);
     ir::Value rd_value;
-    std::tie(last_memory, rd_value) = builder.load_memory(last_memory, type, address);
+    std::tie(last_memory, rd_value) = builder.load_memory(last_memory, type, address, pc, instret);
     emit_store_register(inst.rd(), rd_value, sext);
 }
 
 void Frontend::emit_store(Instruction inst, ir::Type type) {
-    update_pc();
-    update_instret();
+    prepare_memory_access();
 
     auto rs2_value = emit_load_register(type, inst.rs2());
     auto rs1_value = emit_load_register(ir::Type::i64, inst.rs1());
     auto imm_value = builder.constant(ir::Type::i64, inst.imm());
     auto address = builder.arithmetic(ir::Opcode::add, rs1_value, imm_value);
-    last_memory = builder.store_memory(last_memory, address, rs2_value);
+    last_memory = builder.store_memory(last_memory, address, rs2_value, pc, instret);
 }
 
 void Frontend::emit_alui(Instruction inst, uint16_t opcode, bool w) {
@@ -356,6 +367,9 @@ void Frontend::compile(const Basic_block& block) {
             if (inst.rd()) {
                 auto end_pc_value = builder.constant(ir::Type::i64, pc + inst.length());
                 last_memory = builder.store_register(last_memory, inst.rd(), end_pc_value);
+
+                // Calls are identified by using ra as link register.
+                if (inst.rd() == 1) emit_push_return(end_pc_value);
             }
             ASSERT(pc + inst.length() == block.end_pc);
             auto new_pc_value = builder.constant(ir::Type::i64, pc + inst.imm());
@@ -373,6 +387,8 @@ void Frontend::compile(const Basic_block& block) {
             if (inst.rd()) {
                 auto end_pc_value = builder.constant(ir::Type::i64, pc + inst.length());
                 last_memory = builder.store_register(last_memory, inst.rd(), end_pc_value);
+
+                if (inst.rd() == 1) emit_push_return(end_pc_value);
             }
             last_memory = builder.store_register(last_memory, 64, new_pc_value);
             break;
@@ -343,6 +343,7 @@ void step(Context *context, Instruction inst) {
                 context->registers[14],
                 context->registers[15]
             );
+            if (emu::code_modified) context->executor->code_modified();
             break;
         case Opcode::ebreak:
             throw "Break point";
@@ -1,36 +1,104 @@
 #include <sys/mman.h>
 
+#include <algorithm>
+#include <new>
+
 #include "util/assert.h"
 #include "util/code_buffer.h"
 #include "util/format.h"
 
-namespace util::internal {
+namespace util {
+
+Code_cache::Code_cache(size_t limit) {
+    ASSERT(limit >= min_limit);
+
+    // Keep each generation page-aligned.
+    constexpr size_t granularity = generation_count * 4096;
+    limit_ = (limit + granularity - 1) / granularity * granularity;
+    generation_size_ = limit_ / generation_count;
+
+    // The region is reserved as a whole, but as MAP_NORESERVE is used pages are only committed once they are touched.
+    void* addr = mmap(
+        nullptr, limit_, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0
+    );
+    if (addr == MAP_FAILED) {
+        throw std::bad_alloc{};
+    }
+
+    base_ = reinterpret_cast<std::byte*>(addr);
+}
 
-void* code_allocate(size_t element_size, size_t element_alignment, size_t count) {
+Code_cache::~Code_cache() {
+    ASSERT(live_ == 0);
+    munmap(base_, limit_);
+}
 
-    // In a generic allocator this should throw bad_alloc. But in our case we don't really need bad_alloc.
-    // If these ever happen, it will be a programming error.
-    ASSERT(count <= static_cast<size_t>(-1) / element_size);
-    ASSERT(4096 % element_alignment == 0);
+std::pair<std::byte*, std::byte*> Code_cache::next_generation() const noexcept {
+    size_t begin = (generation_ + 1) % generation_count * generation_size_;
+    return { base_ + begin, base_ + begin + generation_size_ };
+}
 
-    size_t size = (element_size * count + 4095) &~ 4095;
+void Code_cache::advance() noexcept {
+    generation_ = (generation_ + 1) % generation_count;
+    top_ = generation_begin();
+    evictions_++;
+}
 
-    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-    if (!addr) {
+void Code_cache::print_statistics(const char* name) const {
+    util::log(
+        "{} code cache: {} of {} KiB live ({}%), peak {} KiB, {} generations of {} KiB evicted.\n",
+        name, live_ / 1024, limit_ / 1024, live_ * 100 / limit_, peak_ / 1024, evictions_, generation_size_ / 1024
+    );
+}
+
+Code_buffer::~Code_buffer() {
+    if (!data_) return;
+
+    cache_.live_ -= size_;
+
+    // If this is the most recent allocation, return the space to the cache. The buffer may belong to a previous
+    // generation if it was abandoned when the cache advanced.
+    if (data_ + size_ == cache_.base_ + cache_.top_ && data_ >= cache_.base_ + cache_.generation_begin()) {
+        cache_.top_ = data_ - cache_.base_;
+    }
+
+    // Once all buffers are freed, holes left by buffers freed earlier can be reused as well.
+    if (cache_.live_ == 0) {
+        cache_.top_ = cache_.generation_begin();
+    }
+}
+
+void Code_buffer::reserve(size_t size) {
+    size_t start;
+    if (!data_) {
+        // Start a new buffer at the top of the cache.
+        start = (cache_.top_ + Code_cache::alignment - 1) &~ (Code_cache::alignment - 1);
+    } else {
+        // Only the most recent allocation can grow, as others are followed by other buffers.
+        ASSERT(data_ + size_ == cache_.base_ + cache_.top_);
+        start = data_ - cache_.base_;
+    }
+
+    size_t end = cache_.generation_begin() + cache_.generation_size_;
+    if (start > end || size > end - start) {
         throw std::bad_alloc{};
     }
 
-    return addr;
+    data_ = cache_.base_ + start;
+    cache_.top_ = start + size_;
 }
 
-void code_deallocate(void *ptr, size_t element_size, size_t element_alignment, size_t count) noexcept {
+void Code_buffer::resize(size_t size) {
+    if (size > size_) reserve(size);
 
-    ASSERT(count <= static_cast<size_t>(-1) / element_size);
-    ASSERT(4096 % element_alignment == 0);
+    // Move the top of the cache along if this is the most recent allocation.
+    if (data_ + size_ == cache_.base_ + cache_.top_) {
+        cache_.top_ = cache_.top_ - size_ + size;
+    }
 
-    if (!ptr) return;
-    size_t size = (element_size * count + 4095) &~ 4095;
-    munmap(ptr, size);
+    cache_.live_ = cache_.live_ - size_ + size;
+    cache_.peak_ = std::max(cache_.peak_, cache_.live_);
+    size_ = size;
 }
 
 }
@@ -1,6 +1,9 @@
-#include <list>
+#include <algorithm>
+#include <cstddef>
 
 #include "emu/state.h"
+#include "riscv/context.h"
+#include "util/int_size.h"
 #include "util/memory.h"
 #include "x86/backend.h"
 #include "x86/builder.h"
@@ -66,8 +69,26 @@ static x86::Operand modify_size(ir::Type type, const x86::Operand& loc) {
     }
 }
 
+static_assert(offsetof(riscv::Context, instret) == 65 * 8);
+
+// Get the host register a guest register is pinned to, or none.
+static x86::Register pinned_register(uint16_t regnum) {
+    for (size_t i = 0; i < x86::backend::Code_generator::pinned_register_count(); i++) {
+        if (x86::backend::pinned_registers[i].first == regnum) return x86::backend::pinned_registers[i].second;
+    }
+    return x86::Register::none;
+}
+
 namespace x86::backend {
 
+int Code_generator::prologue_size() {
+    return emu::state::pin_registers ? pinned_prologue_size : default_prologue_size;
+}
+
+size_t Code_generator::pinned_register_count() {
+    return emu::state::pin_registers ? std::size(pinned_registers) : 1;
+}
+
 void Code_generator::emit(const Instruction& inst) {
     bool disassemble = emu::state::disassemble;
     size_t size_before_emit;
@@ -122,6 +143,12 @@ void Code_generator::emit_binary(ir::Node* node, Opcode opcode) {
     emit(binary(opcode, reg, get_allocation(node->operand(1))));
 }
 
+void Code_generator::emit_memory_binary(ir::Node* node, Opcode opcode) {
+    auto value = node->operand(2);
+    record_memory_access(node);
+    emit(binary(opcode, emit_address(value.type(), node->operand(1)), get_allocation(value)));
+}
+
 void Code_generator::emit_unary(ir::Node* node, Opcode opcode) {
     Register reg = get_allocation(node->value(0)).as_register();
     ASSERT(same_location(get_allocation(node->operand(0)), reg));
@@ -170,11 +197,21 @@ Condition_code Code_generator::emit_compare(ir::Value value) {
         case ir::Opcode::ge: cc = Condition_code::greater_equal; break;
         case ir::Opcode::ltu: cc = Condition_code::below; break;
         case ir::Opcode::geu: cc = Condition_code::above_equal; break;
+        case Target_opcode::test_zero: cc = Condition_code::equal; break;
+        case Target_opcode::test_nonzero: cc = Condition_code::not_equal; break;
         default: ASSERT(0);
     }
 
     Operand loc0 = get_allocation(node->operand(0));
     Operand loc1 = get_allocation(node->operand(1));
+
+    // Test is commutative, but only accepts a memory operand on the left.
+    if (node->opcode() == Target_opcode::test_zero || node->opcode() == Target_opcode::test_nonzero) {
+        if (loc0.is_immediate() || loc1.is_memory()) std::swap(loc0, loc1);
+        emit(test(loc0, loc1));
+        return cc;
+    }
+
     if (loc0.is_immediate()) {
         std::swap(loc0, loc1);
         switch (cc) {
@@ -186,6 +223,12 @@ Condition_code Code_generator::emit_compare(ir::Value value) {
         }
     }
 
+    // Comparing with zero sets flags the same way as testing the register against itself, which is shorter.
+    if (loc0.is_register() && loc1.is_immediate() && loc1.as_immediate() == 0) {
+        emit(test(loc0, loc0));
+        return cc;
+    }
+
     emit(cmp(loc0, loc1));
     return cc;
 }
@@ -217,32 +260,56 @@ Memory Code_generator::emit_address(ir::Type type, ir::Value value) {
     return ret;
 }
 
+void Code_generator::record_memory_access(ir::Node* node) {
+    auto access = static_cast<ir::Memory_access*>(node);
+    _memory_access_sites.push_back({
+        static_cast<uint32_t>(_encoder.buffer().size()), access->instret(), access->pc()
+    });
+}
+
 void Code_generator::visit(ir::Node* node) {
     switch (node->opcode()) {
         case ir::Opcode::load_register: {
             uint16_t regnum = static_cast<ir::Register_access*>(node)->regnum();
 
             // Move the emulated register to 64-bit version of allocated machine register.
-            emit(mov(get_allocation(node->value(1)), qword(Register::rbp + regnum * 8)));
+            Register pinned = pinned_register(regnum);
+            if (pinned != Register::none) {
+                emit(mov(get_allocation(node->value(1)), pinned));
+            } else {
+                emit(mov(get_allocation(node->value(1)), qword(Register::rbp + regnum * 8)));
+            }
             break;
         }
         case ir::Opcode::store_register: {
             uint16_t regnum = static_cast<ir::Register_access*>(node)->regnum();
 
             // Move the allocated machine register back to the emulated register.
-            emit(mov(qword(Register::rbp + regnum * 8), get_allocation(node->operand(1))));
+            Register pinned = pinned_register(regnum);
+            if (pinned != Register::none) {
+                emit(mov(pinned, get_allocation(node->operand(1))));
+            } else {
+                emit(mov(qword(Register::rbp + regnum * 8), get_allocation(node->operand(1))));
+            }
             break;
         }
         case ir::Opcode::load_memory: {
             auto output = node->value(1);
+            record_memory_access(node);
             emit(mov(get_allocation(output), emit_address(output.type(), node->operand(1))));
             break;
         }
         case ir::Opcode::store_memory: {
             auto value = node->operand(2);
+            record_memory_access(node);
             emit(mov(emit_address(value.type(), node->operand(1)), get_allocation(value)));
             break;
         }
+        case Target_opcode::add_memory: emit_memory_binary(node, Opcode::add); break;
+        case Target_opcode::sub_memory: emit_memory_binary(node, Opcode::sub); break;
+        case Target_opcode::xor_memory: emit_memory_binary(node, Opcode::i_xor); break;
+        case Target_opcode::or_memory: emit_memory_binary(node, Opcode::i_or); break;
+        case Target_opcode::and_memory: emit_memory_binary(node, Opcode::i_and); break;
         case Target_opcode::lea: {
             emit(lea(
                 modify_size(ir::Type::i64, get_allocation(node->value(0)).as_register()),
@@ -252,6 +319,10 @@ void Code_generator::visit(ir::Node* node) {
         }
         case ir::Opcode::call: {
             auto call_node = static_cast<ir::Call*>(node);
+
+            // Helpers may fault or unwind, after which pinned registers are lost, so the context is synchronized
+            // before any call. Only helpers taking the context can modify it.
+            store_pinned_registers();
             if (call_node->need_context()) {
                 emit(mov(Register::rdi, Register::rbp));
             }
@@ -259,6 +330,14 @@ void Code_generator::visit(ir::Node* node) {
             // All other arguments should have been placed into the correct register already by register allocator.
             emit(mov(Register::rax, call_node->target()));
             emit(call(Register::rax));
+            if (call_node->need_context()) load_pinned_registers();
+            break;
+        }
+        case ir::Opcode::push_return: emit_push_return(node); break;
+        case ir::Opcode::add_instret: {
+            auto count = static_cast<int64_t>(node->operand(1).const_value());
+            ASSERT(count == static_cast<int32_t>(count));
+            emit(add(pinned_register(65), count));
             break;
         }
         case ir::Opcode::copy: {
@@ -348,6 +427,7 @@ void Code_generator::visit(ir::Node* node) {
 
 bool Code_generator::need_phi(ir::Value control) {
     auto target = ir::analysis::Block::get_target(control);
+    if (!_regalloc.get_edge_moves(control).empty()) return true;
 
     // Find out the operand id, which will tells us the correct operand of PHI node to use.
     size_t id = target->operand_find(control);
@@ -364,8 +444,8 @@ bool Code_generator::need_phi(ir::Value control) {
 void Code_generator::emit_phi(ir::Value control) {
     auto target = ir::analysis::Block::get_target(control);
 
-    // List tracking all moves necessary for the control edge. List is used to ease reordering.
-    std::list<std::pair<Operand, Operand>> phi_nodes;
+    // All moves necessary for the control edge, as (destination, source) pairs.
+    std::vector<std::pair<Operand, Operand>> moves;
 
     // Find out the operand id, which will tells us the correct operand of PHI node to use.
     size_t id = target->operand_find(control);
@@ -374,119 +454,203 @@ void Code_generator::emit_phi(ir::Value control) {
 
         auto src = get_allocation(ref->operand(id + 1));
         auto dst = get_allocation(ref->value(0));
-        if (!same_location(dst, src)) phi_nodes.push_back({dst, src});
+        if (!same_location(dst, src)) moves.push_back({dst, src});
     }
 
-    if (phi_nodes.empty()) return;
+    // Values live across the edge may be at different locations in the two blocks as well.
+    for (auto& move: _regalloc.get_edge_moves(control)) moves.push_back(move);
+
+    emit_parallel_move(moves);
+}
+
+void Code_generator::emit_parallel_move(std::vector<std::pair<Operand, Operand>>& moves) {
+
+    // Moves to memory need R11 unless the source is a register or a 32-bit immediate.
+    auto need_scratch = [](const std::pair<Operand, Operand>& move) {
+        auto& [dst, src] = move;
+        if (!dst.is_memory()) return false;
+        return src.is_memory() || (src.is_immediate() && !util::is_int32(src.as_immediate()));
+    };
+
+    auto is_read = [&](const Operand& loc, size_t except) {
+        for (size_t i = 0; i < moves.size(); i++) {
+            if (i != except && same_location(moves[i].second, loc)) return true;
+        }
+        return false;
+    };
+
+    // Update sources after the values of two locations are swapped, or after the value of the first location is
+    // copied to the second if swap is false, and drop moves that become no-ops.
+    // XXX: This is okay as currently all PHI nodes are i64.
+    auto relocate = [&](const Operand& a, const Operand& b, bool swap) {
+        for (auto& move: moves) {
+            if (same_location(move.second, a)) {
+                move.second = b;
+            } else if (swap && same_location(move.second, b)) {
+                move.second = a;
+            }
+        }
+        moves.erase(std::remove_if(moves.begin(), moves.end(), [](const auto& move) {
+            return same_location(move.first, move.second);
+        }), moves.end());
+    };
 
-    while (true) {
+    while (!moves.empty()) {
+
+        // Emit all moves whose destinations are not read by other moves. Each move emitted may free another one, so
+        // chains are emitted from their end, with one instruction per move.
         bool changed = true;
         while (changed) {
             changed = false;
-
-            // Loop through all PHI nodes, and pick one whose destination is not used
-            auto iter = phi_nodes.begin();
-            while (iter != phi_nodes.end()) {
-                const auto& [dst, src] = *iter;
-
-                // Check if other PHI nodes may need to use old dst.
-                bool has_conflict = false;
-                auto iter2 = phi_nodes.begin();
-                while (iter2 != phi_nodes.end()) {
-                    if (iter2 != iter) {
-                        const auto& src2 = iter2->second;
-                        if (same_location(dst, src2)) {
-                            has_conflict = true;
-                            break;
-                        }
-                    }
-                    ++iter2;
+            for (size_t i = 0; i < moves.size();) {
+                if (is_read(moves[i].first, i)) {
+                    i++;
+                    continue;
                 }
 
-                if (!has_conflict) {
-                    // Move to the designated PHI value storage area.
-                    if (src.is_register() || dst.is_register()) {
-                        emit(mov(dst, src));
-                    } else {
-                        emit(mov(Register::r11, src));
-                        emit(mov(dst, Register::r11));
-                    }
-
-                    changed = true;
-                    iter = phi_nodes.erase(iter);
+                auto& [dst, src] = moves[i];
+                if (need_scratch(moves[i])) {
+                    emit(mov(Register::r11, src));
+                    emit(mov(dst, Register::r11));
                 } else {
-                    ++iter;
+                    emit(mov(dst, src));
                 }
+                moves.erase(moves.begin() + i);
+                changed = true;
             }
         }
 
-        // Break if we successfully emitted all moves.
-        if (phi_nodes.empty()) break;
-
-        // Now we encounter cyclical dependency. To break the cyclical dependency, we can find a node whose src is also
-        // going to modified, then generate `xchg dst, src`, and update dependencies accordingly.
-        auto iter = phi_nodes.begin();
-        while (iter != phi_nodes.end()) {
-            const auto& [dst, src] = *iter;
-
-            // Check if other PHI nodes will write to src.
-            bool will_write = false;
-            auto iter2 = phi_nodes.begin();
-            while (iter2 != phi_nodes.end()) {
-                if (iter2 != iter) {
-                    const auto& src2 = iter2->first;
-                    if (same_location(src, src2)) {
-                        will_write = true;
-                        break;
-                    }
-                }
-                ++iter2;
-            }
+        if (moves.empty()) break;
+
+        // Only cycles, possibly with chains hanging off them, are left. Break one of them. A register-to-register
+        // move is done by xchg, after which the destination is done and the source holds the old destination.
+        auto iter = std::find_if(moves.begin(), moves.end(), [](const auto& move) {
+            return move.first.is_register() && move.second.is_register();
+        });
+        if (iter != moves.end()) {
+            auto [dst, src] = *iter;
+            emit(xchg(dst, src));
+            moves.erase(iter);
+            relocate(src, dst, true);
+            continue;
+        }
 
-            if (will_write) {
-                if (src.is_register() || dst.is_register()) {
-                    emit(xchg(dst, src));
-                } else {
-                    emit(mov(Register::r11, src));
-                    emit(xchg(Register::r11, dst));
-                    emit(mov(src, Register::r11));
-                }
+        // xchg with a memory operand is implicitly locked. Instead save the old value of a destination to R11, which
+        // turns the cycle into a chain, unless R11 is needed for other moves.
+        if (std::none_of(moves.begin(), moves.end(), need_scratch)) {
+            auto dst = moves[0].first;
+            emit(mov(Register::r11, dst));
+            relocate(dst, Register::r11, false);
+            continue;
+        }
 
-                auto iter2 = phi_nodes.begin();
-                while (iter2 != phi_nodes.end()) {
-                    if (iter2 == iter) {
-                        ++iter2;
-                        continue;
-                    }
-                    auto& [dst2, src2] = *iter2;
-                    // XXX: This is okay as currently all PHI nodes are i64.
-                    if (same_location(src2, src)) {
-                        src2 = dst;
-                    } else if (same_location(src2, dst)) {
-                        src2 = src;
-                    } else {
-                        ++iter2;
-                        continue;
-                    }
+        // Cycles among stack slots only are rare, so accept the locked xchg for them.
+        auto [dst, src] = moves[0];
+        emit(mov(Register::r11, src));
+        emit(xchg(Register::r11, dst));
+        emit(mov(src, Register::r11));
+        moves.erase(moves.begin());
+        relocate(src, dst, true);
+    }
+}
 
-                    // dst2 and src2 may end up in the same location if modify them. Elide if possible.
-                    if (same_location(dst2, src2)) {
-                        iter2 = phi_nodes.erase(iter2);
-                    } else {
-                        ++iter2;
-                    }
-                }
+void Code_generator::emit_indirect_exit() {
+    // The next pc is unknown at compile time. Instead of returning to the dispatcher, we probe its instruction cache
+    // here and jump to the translated block directly on hit. The index must agree with emu::Dispatch_cache::index.
+    // Only the most recently used way is compared, the dispatcher handles the rest of the set.
+    int set_bits = _icache.set_bits();
+    emit(mov(Register::rax, qword(Register::rbp + 64 * 8)));
+    emit(mov(Register::rcx, Register::rax));
+    emit(shr(Register::rcx, 1));
+    emit(mov(Register::rdx, Register::rcx));
+    emit(shr(Register::rdx, set_bits));
+    emit(i_xor(Register::ecx, Register::edx));
+    emit(i_and(Register::ecx, (1 << set_bits) - 1));
+    emit(shl(Register::ecx, _icache.way_bits() + 4));
+    emit(mov(Register::rdx, reinterpret_cast<uintptr_t>(_icache.entries())));
+    emit(cmp(Register::rax, qword(Register::rdx + Register::rcx * 1)));
+    emit(jcc(Condition_code::not_equal, 0xAAAA));
+    size_t jcc_end = _encoder.buffer().size();
+
+    // Cache hit. Jump past the prologue, similar to Ir_dbt::patch_trampoline.
+    emit(mov(Register::rax, qword(Register::rdx + Register::rcx * 1 + 8)));
+    emit(add(Register::rax, prologue_size()));
+    emit(jmp(Register::rax));
+
+    // Cache miss. If this is a return, the shadow return stack may know where to continue. All registers are stored at
+    // this point, so the stack pointer can be read from the context.
+    util::write_as<uint32_t>(_encoder.buffer().data() + jcc_end - 4, _encoder.buffer().size() - jcc_end);
+    Register sp = pinned_register(2);
+    if (sp != Register::none) {
+        emit(mov(Register::rcx, sp));
+    } else {
+        emit(mov(Register::rcx, qword(Register::rbp + 2 * 8)));
+    }
+    emit(i_and(Register::ecx, emu::Return_stack::mask));
+    emit(mov(Register::rdx, reinterpret_cast<uintptr_t>(_return_stack->entries)));
+    emit(cmp(Register::rax, qword(Register::rdx + Register::rcx * 1)));
+    emit(jcc(Condition_code::not_equal, 0xAAAA));
+    jcc_end = _encoder.buffer().size();
+    emit(jmp(qword(Register::rdx + Register::rcx * 1 + 8)));
+
+    // Return 0, meaning that nothing needs to be patched.
+    util::write_as<uint32_t>(_encoder.buffer().data() + jcc_end - 4, _encoder.buffer().size() - jcc_end);
+    emit_epilogue();
+    emit(i_xor(Register::eax, Register::eax));
+    emit(ret());
+}
 
-                changed = true;
-                phi_nodes.erase(iter);
-                break;
-            } else {
-                ++iter;
-            }
-        }
+void Code_generator::emit_push_return(ir::Node* node) {
+    auto return_pc = node->operand(2);
+    ASSERT(return_pc.is_const());
+
+    // Locate the entry using the stack pointer.
+    emit_move(ir::Type::i64, Register::rax, get_allocation(node->operand(1)));
+    emit(i_and(Register::eax, emu::Return_stack::mask));
+    emit(mov(Register::rdx, reinterpret_cast<uintptr_t>(_return_stack->entries)));
+    emit(add(Register::rdx, Register::rax));
+
+    // Fill in the return address and the stub to continue at. The latter is filled in after all code is emitted.
+    emit(mov(Register::rax, return_pc.const_value()));
+    emit(mov(qword(Register::rdx + 0), Register::rax));
+    emit(mov(Register::rax, 0xCCCCCCCCCCCC));
+    _return_stub_use.push_back(_encoder.buffer().size() - 8);
+    emit(mov(qword(Register::rdx + 8), Register::rax));
+}
+
+void Code_generator::store_pinned_registers() {
+    for (size_t i = 0; i < pinned_register_count(); i++) {
+        auto [regnum, reg] = pinned_registers[i];
+        emit(mov(qword(Register::rbp + regnum * 8), reg));
+    }
+}
+
+void Code_generator::load_pinned_registers() {
+    for (size_t i = 0; i < pinned_register_count(); i++) {
+        auto [regnum, reg] = pinned_registers[i];
+        emit(mov(reg, qword(Register::rbp + regnum * 8)));
+    }
+}
 
-        ASSERT(changed);
+void Code_generator::emit_epilogue() {
+    store_pinned_registers();
+    emit(add(Register::rsp, 8));
+    for (size_t i = pinned_register_count(); i-- > 0;) {
+        emit(pop(pinned_registers[i].second));
     }
+    emit(pop(Register::rbp));
+}
+
+void Code_generator::emit_trampoline(std::vector<size_t>& trampoline_loc) {
+    trampoline_loc.push_back(_encoder.buffer().size());
+
+    // Trampoline. It will be patched later. The patched jump replaces the first 12 bytes, so the epilogue is placed
+    // after them.
+    emit(mov(Register::rax, 0xCCCCCCCCC));
+    emit(nop());
+    emit(nop());
+    emit_epilogue();
+    emit(ret());
 }
 
 void Code_generator::run() {
@@ -495,6 +659,16 @@ void Code_generator::run() {
     int stack_size = _regalloc.get_stack_size();
     emit(push(Register::rbp));
     emit(mov(Register::rbp, Register::rdi));
+
+    // Callee-saved registers are saved before pinned registers are loaded into them. There is always an odd number of
+    // them, so the padding keeps the stack aligned.
+    for (size_t i = 0; i < pinned_register_count(); i++) emit(push(pinned_registers[i].second));
+    emit(sub(Register::rsp, 8));
+
+    // Record where the frame is for the unwinder. Chained blocks skip this, but they share the same frame.
+    emit(mov(qword(Register::rbp + offsetof(riscv::Context, host_sp)), Register::rsp));
+    load_pinned_registers();
+    ASSERT(_encoder.buffer().size() == static_cast<size_t>(prologue_size()));
     if (stack_size) emit(sub(Register::rsp, stack_size));
 
     // Get a linear list of blocks.
@@ -510,6 +684,9 @@ void Code_generator::run() {
 
     size_t exit_refcount = _graph.exit()->operand_count();
 
+    // Locations of jumps to blocks splitting critical edges, and the edges.
+    std::vector<std::pair<size_t, ir::Value>> split_edges;
+
     emit_phi(_graph.entry()->value(0));
 
     for (size_t i = 0; i < blocks.size() - 1; i++) {
@@ -557,8 +734,13 @@ void Code_generator::run() {
                     std::swap(true_need_phi, false_need_phi);
                 }
 
-                // If we can swap targets to get a fallthrough.
-                if (true_target == next_block && true_need_phi == false_need_phi) {
+                // If we can swap targets to get a fallthrough. When both edges need moves and neither target follows,
+                // keep the moves of a back edge inline, as loops are where time is spent.
+                bool swap = true_target == next_block;
+                if (true_need_phi && target != next_block && label_def.count(true_target) && !label_def.count(target)) {
+                    swap = true;
+                }
+                if (swap && true_need_phi == false_need_phi) {
                     // Invert condition code.
                     cc = static_cast<Condition_code>(static_cast<uint8_t>(cc) ^ 1);
                     std::swap(true_target, target);
@@ -566,15 +748,10 @@ void Code_generator::run() {
                 }
 
                 if (true_need_phi) {
-                    emit(jcc(static_cast<Condition_code>(static_cast<uint8_t>(cc) ^ 1), 0xAAAA));
-                    size_t s = _encoder.buffer().size();
-                    emit_phi(target_control_true);
-                    emit(jmp(0xCAFE));
-
-                    label_use[true_target].push_back(_encoder.buffer().size());
-
-                    size_t s2 = _encoder.buffer().size();
-                    util::write_as<uint32_t>(_encoder.buffer().data() + s - 4, s2 - s);
+                    // Both edges need moves, so the taken edge is critical. Split it by a block placed after all
+                    // others, so the fallthrough path does not need to jump over the moves.
+                    emit(jcc(cc, 0xAAAA));
+                    split_edges.push_back({_encoder.buffer().size(), target_control_true});
 
                 } else {
                     emit(jcc(cc, 0xAAAA));
@@ -596,13 +773,7 @@ void Code_generator::run() {
                 // And then when the target address is known, the trampoline will be replaced with the jump.
 
                 if (stack_size) emit(add(Register::rsp, stack_size));
-
-                trampoline_loc.push_back(_encoder.buffer().size());
-
-                // Trampoline. It will be patched later.
-                emit(pop(Register::rbp));
-                emit(mov(Register::rax, 0xCCCCCCCCC));
-                emit(ret());
+                emit_trampoline(trampoline_loc);
 
                 exit_refcount--;
                 continue;
@@ -619,6 +790,19 @@ void Code_generator::run() {
 
     label_def[_graph.exit()] = _encoder.buffer().size();
 
+    if (exit_refcount) {
+        if (stack_size) emit(add(Register::rsp, stack_size));
+        emit_indirect_exit();
+    }
+
+    // Blocks splitting critical edges.
+    for (auto [use, control]: split_edges) {
+        util::write_as<uint32_t>(_encoder.buffer().data() + use - 4, _encoder.buffer().size() - use);
+        emit_phi(control);
+        emit(jmp(0xCAFE));
+        label_use[ir::analysis::Block::get_target(control)].push_back(_encoder.buffer().size());
+    }
+
     // Patching labels
     for (const auto& pair: label_def) {
         auto& uses = label_use[pair.first];
@@ -627,19 +811,25 @@ void Code_generator::run() {
         }
     }
 
-    // Patching trampolines.
-    for (auto loc: trampoline_loc) {
-        uintptr_t rip = reinterpret_cast<uintptr_t>(_encoder.buffer().data()) + loc;
-        util::write_as<uint64_t>(reinterpret_cast<void*>(rip + 3), rip);
+    // For each pushed return address, we need a stub to continue after return. The stub is a trampoline, so it will be
+    // patched to jump to the translated block of the return address after the first return.
+    std::vector<size_t> return_stub_loc;
+    for (size_t i = 0; i < _return_stub_use.size(); i++) {
+        return_stub_loc.push_back(_encoder.buffer().size());
+        emit_trampoline(trampoline_loc);
     }
 
-    if (exit_refcount) {
-        if (stack_size) emit(add(Register::rsp, stack_size));
-        emit(pop(Register::rbp));
+    for (size_t i = 0; i < _return_stub_use.size(); i++) {
+        util::write_as<uint64_t>(
+            _encoder.buffer().data() + _return_stub_use[i],
+            reinterpret_cast<uintptr_t>(_encoder.buffer().data()) + return_stub_loc[i]
+        );
+    }
 
-        // Return 0, meaning that nothing needs to be patched.
-        emit(i_xor(Register::eax, Register::eax));
-        emit(ret());
+    // Patching trampolines. This must happen at the very end as the buffer may be reallocated when emitting code.
+    for (auto loc: trampoline_loc) {
+        uintptr_t rip = reinterpret_cast<uintptr_t>(_encoder.buffer().data()) + loc;
+        util::write_as<uint64_t>(reinterpret_cast<void*>(rip + 2), rip);
     }
 }
 
@@ -1,3 +1,6 @@
+#include <algorithm>
+
+#include "emu/state.h"
 #include "ir/builder.h"
 #include "ir/visit.h"
 #include "util/int_size.h"
@@ -5,6 +8,19 @@
 
 namespace x86::backend {
 
+namespace {
+
+// Binary operations x86 can perform on a memory destination, and the target opcodes doing so.
+constexpr std::pair<uint16_t, uint16_t> memory_operations[] = {
+    {ir::Opcode::add, Target_opcode::add_memory},
+    {ir::Opcode::sub, Target_opcode::sub_memory},
+    {ir::Opcode::i_xor, Target_opcode::xor_memory},
+    {ir::Opcode::i_or, Target_opcode::or_memory},
+    {ir::Opcode::i_and, Target_opcode::and_memory},
+};
+
+}
+
 ir::Value Lowering::match_address(ir::Value value, bool required) {
     if (value.opcode() == Target_opcode::lea) {
         if (value.references().size() == 1) {
@@ -95,7 +111,83 @@ ir::Value Lowering::match_address(ir::Value value, bool required) {
     ))->value(0);
 }
 
+void Lowering::match_test(ir::Node* node) {
+    auto op = node->operand(0);
+    auto rhs = node->operand(1);
+
+    // Value numbering has moved constants to the right. Unsigned x < 1 is x == 0, as produced by seqz.
+    if (!rhs.is_const()) return;
+    uint16_t opcode;
+    switch (node->opcode()) {
+        case ir::Opcode::eq: opcode = rhs.const_value() == 0 ? Target_opcode::test_zero : 0; break;
+        case ir::Opcode::ne: opcode = rhs.const_value() == 0 ? Target_opcode::test_nonzero : 0; break;
+        case ir::Opcode::ltu: opcode = rhs.const_value() == 1 ? Target_opcode::test_zero : 0; break;
+        case ir::Opcode::geu: opcode = rhs.const_value() == 1 ? Target_opcode::test_nonzero : 0; break;
+        default: ASSERT(0);
+    }
+
+    // The bitwise and itself is not needed if only compared.
+    if (!opcode || op.opcode() != ir::Opcode::i_and || op.references().size() != 1) return;
+    replace_value(node->value(0), _graph.manage(new ir::Node(
+        opcode, {ir::Type::i1}, ir::Node::Operand_container(op.node()->operands())
+    ))->value(0));
+}
+
+void Lowering::match_memory_operation(ir::Node* store) {
+
+    // Accesses to guest registers in between can be reordered with the load, but nothing else touching memory or the
+    // context can be.
+    auto load = store->operand(0).node();
+    while (load->opcode() == ir::Opcode::load_register || load->opcode() == ir::Opcode::store_register) {
+        load = load->operand(0).node();
+    }
+    if (load->opcode() != ir::Opcode::load_memory || load->operand(1) != store->operand(1)) return;
+
+    // Neither the loaded value nor the result can be used elsewhere.
+    auto loaded = load->value(1);
+    auto result = store->operand(2);
+    if (loaded.references().size() != 1 || result.references().size() != 1) return;
+
+    auto op = result.node();
+    auto pattern = std::find_if(std::begin(memory_operations), std::end(memory_operations), [op](const auto& pair) {
+        return pair.first == op->opcode();
+    });
+    if (pattern == std::end(memory_operations)) return;
+
+    ir::Value operand;
+    if (op->operand(0) == loaded) {
+        operand = op->operand(1);
+    } else if (ir::is_commutative_opcode(op->opcode()) && op->operand(1) == loaded) {
+        operand = op->operand(0);
+    } else {
+        return;
+    }
+
+    // The load is removed from the memory chain, and the fused node takes the place of the store.
+    auto access = static_cast<ir::Memory_access*>(load);
+    auto fused = _graph.manage(new ir::Memory_access(
+        access->pc(), access->instret(), pattern->second, {ir::Type::memory},
+        {store->operand(0), store->operand(1), operand}
+    ));
+    replace_value(store->value(0), fused->value(0));
+    replace_value(load->value(0), load->operand(0));
+}
+
 void Lowering::run() {
+
+    // A single instruction accessing memory twice can only be attributed to one guest instruction, here the load, so it
+    // faults at the load even if only the store should, e.g. on a read-only page. Only do this without strict
+    // exceptions. Addresses are compared before they are matched below, and dead users are collected first so that
+    // references only count live ones.
+    if (!emu::state::strict_exception) {
+        _graph.garbage_collect();
+        std::vector<ir::Node*> stores;
+        visit_postorder(_graph, [&stores](ir::Node* node) {
+            if (node->opcode() == ir::Opcode::store_memory) stores.push_back(node);
+        });
+        for (auto store: stores) match_memory_operation(store);
+    }
+
     visit_postorder(_graph, [this](ir::Node* node) {
         switch (node->opcode()) {
             case ir::Opcode::load_memory: {
@@ -103,11 +195,22 @@ void Lowering::run() {
                 node->operand_set(1, addr);
                 break;
             }
-            case ir::Opcode::store_memory: {
+            case ir::Opcode::store_memory:
+            case Target_opcode::add_memory:
+            case Target_opcode::sub_memory:
+            case Target_opcode::xor_memory:
+            case Target_opcode::or_memory:
+            case Target_opcode::and_memory: {
                 auto addr = match_address(node->operand(1), true);
                 if (addr) node->operand_set(1, addr);
                 break;
             }
+            case ir::Opcode::eq:
+            case ir::Opcode::ne:
+            case ir::Opcode::ltu:
+            case ir::Opcode::geu:
+                match_test(node);
+                break;
             case ir::Opcode::add: {
                 auto output = node->value(0);
                 auto addr = match_address(output, false);
@@ -144,6 +247,13 @@ void Dot_printer::write_node_content(std::ostream& stream, ir::Node* node) {
     switch (node->opcode()) {
         case Target_opcode::address: stream << "x86::address"; break;
         case Target_opcode::lea: stream << "x86::lea"; break;
+        case Target_opcode::test_zero: stream << "x86::test_zero"; break;
+        case Target_opcode::test_nonzero: stream << "x86::test_nonzero"; break;
+        case Target_opcode::add_memory: stream << "x86::add_memory"; break;
+        case Target_opcode::sub_memory: stream << "x86::sub_memory"; break;
+        case Target_opcode::xor_memory: stream << "x86::xor_memory"; break;
+        case Target_opcode::or_memory: stream << "x86::or_memory"; break;
+        case Target_opcode::and_memory: stream << "x86::and_memory"; break;
         default: ASSERT(0);
     }
 }
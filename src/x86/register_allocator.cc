@@ -1,5 +1,9 @@
+#include <cstdint>
+
+#include "emu/state.h"
 #include "util/assert.h"
 #include "util/int_size.h"
+#include "util/reverse_iterable.h"
 #include "x86/backend.h"
 #include "x86/builder.h"
 
@@ -45,8 +49,48 @@ static bool same_location(const x86::Operand& a, const x86::Operand& b) {
     return am.base == bm.base && am.index == bm.index && am.scale == bm.scale && am.displacement == bm.displacement;
 }
 
+// Get the 64-bit version of a location, so moves of values of any size on control edges can be reordered together.
+static x86::Operand widen(const x86::Operand& loc) {
+    if (loc.is_register()) return register_of_id(ir::Type::i64, register_id(loc.as_register()));
+    x86::Memory mem = loc.as_memory();
+    mem.size = 8;
+    return mem;
+}
+
 namespace x86::backend {
 
+// Compares and addresses are emitted by their users, so their operands are used where their users are.
+static bool is_folded(uint16_t opcode) {
+    switch (opcode) {
+        case ir::Opcode::eq:
+        case ir::Opcode::ne:
+        case ir::Opcode::lt:
+        case ir::Opcode::ge:
+        case ir::Opcode::ltu:
+        case ir::Opcode::geu:
+        case Target_opcode::test_zero:
+        case Target_opcode::test_nonzero:
+        case Target_opcode::address:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether the value is held in a register or a stack slot.
+static bool is_allocated(ir::Value value) {
+    if (value.is_const() || is_folded(value.opcode())) return false;
+    auto type = value.type();
+    return type != ir::Type::none && type != ir::Type::memory && type != ir::Type::control;
+}
+
+Register_allocator::Register_allocator(
+    ir::Graph& graph, ir::analysis::Block& block_analysis, ir::analysis::Scheduler& scheduler
+): _graph{graph}, _block_analysis{block_analysis}, _scheduler{scheduler},
+    _global_regalloc{emu::state::global_regalloc} {
+
+}
+
 Register Register_allocator::alloc_register_no_spill(ir::Type type, Register hint) {
 
     // If hint is given, try to use it first
@@ -84,6 +128,12 @@ Register Register_allocator::alloc_register(ir::Type type, Register hint) {
         return reg;
     }
 
+    if (_global_regalloc) {
+        reg = register_of_id(type, register_id(choose_spill_register()));
+        spill_register(reg);
+        return reg;
+    }
+
     for (int loc : volatile_register) {
         if (!_pinned[loc]) {
             reg = register_of_id(type, loc);
@@ -113,6 +163,13 @@ void Register_allocator::spill_register(Register reg) {
     auto ptr = _memory_node.find(value);
     if (ptr == _memory_node.end()) {
 
+        // Nothing needs to be stored if the value can be computed again.
+        if (can_rematerialize(value)) {
+            for (auto operand: remat_operands(value)) _reference_count[operand]++;
+            _rematerialized.insert(value);
+            return;
+        }
+
         // Create a copy of the node and assign a stack slot.
         auto copied_value = create_copy(actual_value);
         _allocation[copied_value] = alloc_stack_slot(value.type());
@@ -172,16 +229,19 @@ void Register_allocator::bind_register(ir::Value value, Register loc) {
     _allocation[value] = loc;
 
     ASSERT(!_register_content[register_id(loc)]);
-    if (value.references().empty()) {
+    int count = use_count(value);
+    if (count == 0) {
         return;
     }
 
     _actual_node[value] = value;
     _register_content[register_id(loc)] = value;
-    _reference_count[value] = value.references().size();
+    _reference_count[value] = count;
 }
 
 void Register_allocator::ensure_register(ir::Value value, Register reg) {
+    if (_rematerialized.count(value)) rematerialize(value);
+
     ir::Value& actual_value = _actual_node[value];
     Operand loc = _allocation[actual_value];
 
@@ -227,6 +287,13 @@ void Register_allocator::decrease_reference(ir::Value value) {
         // Remove from reference counting map.
         _reference_count.erase(refptr);
 
+        // Release operands kept live for rematerialization.
+        if (_rematerialized.erase(value)) {
+            _actual_node.erase(value);
+            for (auto operand: remat_operands(value)) decrease_reference(operand);
+            return;
+        }
+
         // Get the actual value and remove from the map.
         auto nodeptr = _actual_node.find(value);
         ASSERT(nodeptr != _actual_node.end());
@@ -284,6 +351,8 @@ ir::Value Register_allocator::get_actual_value(ir::Value value, bool allow_mem,
         return copied_value;
     }
 
+    if (_rematerialized.count(value)) return rematerialize(value);
+
     ir::Value& actual_value = _actual_node[value];
     const Operand& loc = _allocation[actual_value];
     if (allow_mem || loc.is_register()) return actual_value;
@@ -365,6 +434,518 @@ void Register_allocator::emit_address(ir::Value value) {
     }
 }
 
+std::vector<ir::Value> Register_allocator::remat_operands(ir::Value value) {
+    auto& operands = _remat_address[value];
+    std::vector<ir::Value> ret;
+
+    // These are the operands emit_address will dereference.
+    auto base = operands[0];
+    if (!base.is_const()) ret.push_back(base);
+    if (operands[2].const_value() != 0 && !operands[1].is_const()) ret.push_back(operands[1]);
+    return ret;
+}
+
+bool Register_allocator::can_rematerialize(ir::Value value) {
+    if (_remat_address.find(value) == _remat_address.end()) return false;
+
+    // Values live across blocks or used by PHI nodes need an actual location at the end of the block.
+    if (_global_regalloc && _live_out[_block].count(value)) return false;
+    for (auto ref: value.references()) {
+        if (ref->opcode() == ir::Opcode::phi) return false;
+    }
+
+    for (auto operand: remat_operands(value)) {
+        if (_reference_count.find(operand) == _reference_count.end()) return false;
+    }
+    return true;
+}
+
+ir::Value Register_allocator::rematerialize(ir::Value value) {
+    _rematerialized.erase(value);
+
+    // Build a new LEA node from the original operands, handled the same way as the original one.
+    auto address = _graph.manage(new ir::Node(
+        Target_opcode::address, {ir::Type::i64}, ir::Node::Operand_container(_remat_address[value])
+    ))->value(0);
+    auto lea_node = _graph.manage(new ir::Node(Target_opcode::lea, {value.type()}, {address}));
+    emit_address(address);
+    Register reg = alloc_register(value.type());
+
+    // The node must be placed after the copies created above.
+    _nodelist->insert(_nodelist->begin() + _node_index, lea_node);
+    _node_index++;
+
+    auto copied_value = lea_node->value(0);
+    _allocation[copied_value] = reg;
+    _actual_node[value] = copied_value;
+    _register_content[register_id(reg)] = value;
+    return copied_value;
+}
+
+int Register_allocator::use_count(ir::Value value) {
+    if (!_global_regalloc) return value.references().size();
+
+    auto& uses = _local_uses[_block];
+    auto ptr = uses.find(value);
+    return (ptr != uses.end() ? ptr->second : 0) + _live_out[_block].count(value);
+}
+
+size_t Register_allocator::next_use(ir::Value value) {
+    auto uses = [value](ir::Node* node) {
+        for (auto operand: node->operands()) {
+            if (operand == value) return true;
+            if (is_folded(operand.opcode())) {
+                for (auto folded: operand.node()->operands()) {
+                    if (folded == value) return true;
+                }
+            }
+        }
+        return false;
+    };
+
+    for (size_t i = _node_index; i < _nodelist->size(); i++) {
+        if (uses((*_nodelist)[i])) return i - _node_index;
+    }
+
+    // Uses by the end of the block and by PHI nodes of successors come after all nodes.
+    size_t distance = _nodelist->size() - _node_index;
+    auto end = static_cast<ir::Paired*>(_block)->mate();
+    if (uses(end)) return distance;
+    for (auto control: end->values()) {
+        auto target = ir::analysis::Block::get_target(control);
+        if (target->opcode() == ir::Opcode::exit) continue;
+
+        size_t id = target->operand_find(control);
+        for (auto ref: target->value(0).references()) {
+            if (ref->opcode() == ir::Opcode::phi && ref->operand(id + 1) == value) return distance;
+        }
+    }
+
+    return _live_out[_block].count(value) ? distance + 1 : SIZE_MAX;
+}
+
+Register Register_allocator::choose_spill_register() {
+    int best = -1;
+    size_t best_distance = 0;
+    bool best_stored = false;
+    for (int reg: volatile_register) {
+        if (_pinned[reg]) continue;
+
+        auto value = _register_content[reg];
+        ASSERT(value);
+        size_t distance = next_use(value);
+
+        // Values already having a spilled copy or that can be recomputed need no store, so prefer them among equally
+        // distant ones.
+        bool stored = _memory_node.find(value) != _memory_node.end() || can_rematerialize(value);
+        if (best == -1 || distance > best_distance || (distance == best_distance && stored && !best_stored)) {
+            best = reg;
+            best_distance = distance;
+            best_stored = stored;
+        }
+    }
+
+    ASSERT(best != -1);
+    return register_of_id(ir::Type::i64, best);
+}
+
+void Register_allocator::compute_liveness() {
+    std::unordered_map<ir::Node*, std::unordered_set<ir::Value>> defs;
+
+    auto count_uses = [this](ir::Node* block, ir::Node* node) {
+        for (auto operand: node->operands()) {
+            if (is_folded(operand.opcode())) {
+                for (auto folded: operand.node()->operands()) {
+                    if (is_allocated(folded)) _local_uses[block][folded]++;
+                }
+            } else if (is_allocated(operand)) {
+                _local_uses[block][operand]++;
+            }
+        }
+    };
+
+    for (auto block: _block_analysis.blocks()) {
+        for (auto node: _scheduler.get_node_list(block)) {
+            if (is_folded(node->opcode())) continue;
+            count_uses(block, node);
+            for (auto value: node->values()) {
+                if (is_allocated(value)) defs[block].insert(value);
+            }
+        }
+        count_uses(block, static_cast<ir::Paired*>(block)->mate());
+
+        // Operands of PHI nodes are used at the end of the corresponding predecessor.
+        for (auto ref: block->value(0).references()) {
+            if (ref->opcode() != ir::Opcode::phi) continue;
+            defs[block].insert(ref->value(0));
+            for (size_t i = 0; i < block->operand_count(); i++) {
+                auto control = block->operand(i);
+                auto operand = ref->operand(i + 1);
+                if (control.opcode() == ir::Opcode::entry || !is_allocated(operand)) continue;
+                _local_uses[static_cast<ir::Paired*>(control.node())->mate()][operand]++;
+            }
+        }
+    }
+
+    // Standard backward data-flow analysis. Sets only grow, so comparing sizes is enough to detect changes.
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto block: util::reverse_iterable(_block_analysis.blocks())) {
+            auto& live_out = _live_out[block];
+            for (auto control: static_cast<ir::Paired*>(block)->mate()->values()) {
+                for (auto ref: control.references()) {
+                    if (ref->opcode() == ir::Opcode::exit) continue;
+                    auto& target_live_in = _live_in[ref];
+                    live_out.insert(target_live_in.begin(), target_live_in.end());
+                }
+            }
+
+            auto& live_in = _live_in[block];
+            auto& block_defs = defs[block];
+            size_t size = live_in.size();
+            for (auto& pair: _local_uses[block]) {
+                if (!block_defs.count(pair.first)) live_in.insert(pair.first);
+            }
+            for (auto value: live_out) {
+                if (!block_defs.count(value)) live_in.insert(value);
+            }
+            if (live_in.size() != size) changed = true;
+        }
+    }
+}
+
+void Register_allocator::enter_block(ir::Node* block) {
+    _block = block;
+    _actual_node.clear();
+    _memory_node.clear();
+    _reference_count.clear();
+    _rematerialized.clear();
+    _recent_freed_memory.clear();
+    _register_content = {};
+
+    // Values live into the block start where they are at the end of a predecessor already allocated, so only other
+    // edges need moves. A spilled copy is only known to be valid on other edges if the value is in it.
+    ir::Value pred_control;
+    for (auto control: block->operands()) {
+        if (control.opcode() == ir::Opcode::entry) continue;
+        if (_end_state.count(static_cast<ir::Paired*>(control.node())->mate())) {
+            pred_control = control;
+            break;
+        }
+    }
+
+    auto& entry_state = _entry_state[block];
+    for (auto value: _live_in[block]) {
+        Location loc;
+        if (pred_control) {
+            auto& end_state = _end_state[static_cast<ir::Paired*>(pred_control.node())->mate()];
+            ASSERT(end_state.count(value));
+            loc = end_state[value];
+            if (block->operand_count() != 1 && loc.memory != loc.actual) loc.memory = {};
+
+        } else {
+
+            // No predecessor is allocated yet, which is possible as blocks are reordered. Give the value a new stack
+            // slot, represented by a copy that is never emitted.
+            auto placeholder = _graph.manage(new ir::Node(ir::Opcode::copy, {value.type()}, {value}))->value(0);
+            _stack_size += 8;
+            Memory mem = qword(Register::rsp + (_stack_size - 8));
+            mem.size = get_type_size(value.type()) / 8;
+            _allocation[placeholder] = mem;
+            loc = {placeholder, placeholder};
+        }
+
+        entry_state[value] = loc.actual;
+        _actual_node[value] = loc.actual;
+        if (loc.memory) _memory_node[value] = loc.memory;
+        _reference_count[value] = use_count(value);
+        const Operand& op = _allocation[loc.actual];
+        if (op.is_register()) _register_content[register_id(op.as_register())] = value;
+    }
+
+    // Stack slots are free unless they hold a value live into the block.
+    std::vector<bool> used_slot(_stack_size / 8);
+    auto mark_slot = [&](ir::Value value) {
+        const Operand& op = _allocation[value];
+        if (op.is_memory()) used_slot[op.as_memory().displacement / 8] = true;
+    };
+    for (auto& pair: _actual_node) mark_slot(pair.second);
+    for (auto& pair: _memory_node) mark_slot(pair.second);
+
+    // PHI nodes take the location of their operand from the predecessor chosen above if it is free, which coalesces
+    // the copy on that edge. Otherwise they take a free register, leaving R11 to the code generator, or a stack slot.
+    std::array<bool, 16> taken {};
+    size_t pred_index = pred_control ? block->operand_find(pred_control) : 0;
+    for (auto ref: block->value(0).references()) {
+        if (ref->opcode() != ir::Opcode::phi) continue;
+        auto value = ref->value(0);
+
+        Operand loc = Register::none;
+        auto operand = pred_control ? ref->operand(pred_index + 1) : ir::Value{};
+        if (operand && !operand.is_const()) {
+            const Operand& op = _allocation[operand];
+            if (op.is_register()) {
+                int id = register_id(op.as_register());
+                if (id != 11 && !_register_content[id] && !taken[id]) loc = register_of_id(value.type(), id);
+            } else if (!used_slot[op.as_memory().displacement / 8]) {
+                loc = op;
+            }
+        }
+
+        if (loc.is_register() && loc.as_register() == Register::none) {
+            for (int reg: volatile_register) {
+                if (reg != 11 && !_register_content[reg] && !taken[reg]) {
+                    loc = register_of_id(value.type(), reg);
+                    break;
+                }
+            }
+        }
+
+        if (loc.is_register() && loc.as_register() == Register::none) {
+            size_t slot = std::find(used_slot.begin(), used_slot.end(), false) - used_slot.begin();
+            if (slot == used_slot.size()) {
+                _stack_size += 8;
+                used_slot.push_back(false);
+            }
+            Memory mem = qword(Register::rsp + slot * 8);
+            mem.size = get_type_size(value.type()) / 8;
+            loc = mem;
+        }
+
+        _allocation[value] = loc;
+        if (loc.is_register()) {
+            taken[register_id(loc.as_register())] = true;
+        } else {
+            used_slot[loc.as_memory().displacement / 8] = true;
+        }
+
+        int count = use_count(value);
+        if (count == 0) continue;
+        _actual_node[value] = value;
+        _reference_count[value] = count;
+        if (loc.is_register()) {
+            _register_content[register_id(loc.as_register())] = value;
+        } else {
+            _memory_node[value] = value;
+        }
+    }
+
+    _free_memory.clear();
+    for (size_t i = 0; i < used_slot.size(); i++) {
+        if (!used_slot[i]) _free_memory.push_back(qword(Register::rsp + i * 8));
+    }
+}
+
+void Register_allocator::leave_block(ir::Node* block) {
+    auto& end_state = _end_state[block];
+    for (auto& [value, actual]: _actual_node) {
+        auto memory = _memory_node.find(value);
+        end_state[value] = {actual, memory != _memory_node.end() ? memory->second : ir::Value{}};
+    }
+}
+
+void Register_allocator::compute_edge_moves() {
+    for (auto block: _block_analysis.blocks()) {
+        auto& end_state = _end_state[block];
+        for (auto control: static_cast<ir::Paired*>(block)->mate()->values()) {
+            auto target = ir::analysis::Block::get_target(control);
+            if (target->opcode() == ir::Opcode::exit) continue;
+
+            auto& moves = _edge_moves[control];
+            for (auto& [value, actual]: _entry_state[target]) {
+                ASSERT(end_state.count(value));
+                const Operand& dst = _allocation[actual];
+                const Operand& src = _allocation[end_state[value].actual];
+                if (!same_location(dst, src)) moves.push_back({widen(dst), widen(src)});
+            }
+        }
+    }
+}
+
+void Register_allocator::color_stack_slots() {
+    auto is_slot = [this](ir::Value value) {
+        if (!value || value.is_const()) return false;
+        auto ptr = _allocation.find(value);
+        return ptr != _allocation.end() && ptr->second.is_memory();
+    };
+
+    // Stack slots read by a node, including through compares and addresses folded into it.
+    auto slot_uses = [&](ir::Node* node) {
+        std::vector<ir::Value> uses;
+        for (auto operand: node->operands()) {
+            if (is_folded(operand.opcode())) {
+                for (auto folded: operand.node()->operands()) {
+                    if (is_slot(folded)) uses.push_back(folded);
+                }
+            } else if (is_slot(operand)) {
+                uses.push_back(operand);
+            }
+        }
+        return uses;
+    };
+
+    // Slots are written on control edges for PHI nodes and for locations of values differing between the two blocks.
+    // The slot read instead on the edge is one of the predecessor.
+    std::unordered_map<ir::Value, std::vector<ir::Value>> edge_defs;
+    std::unordered_map<ir::Value, std::vector<ir::Value>> edge_uses;
+    std::unordered_map<ir::Value, std::vector<ir::Value>> affinity;
+    for (auto block: _block_analysis.blocks()) {
+        for (auto control: static_cast<ir::Paired*>(block)->mate()->values()) {
+            auto target = ir::analysis::Block::get_target(control);
+            if (target->opcode() == ir::Opcode::exit) continue;
+
+            auto& defs = edge_defs[control];
+            auto& uses = edge_uses[control];
+            auto relate = [&](ir::Value dst, ir::Value src) {
+                if (is_slot(dst)) defs.push_back(dst);
+                if (is_slot(src)) uses.push_back(src);
+                if (is_slot(dst) && is_slot(src)) {
+                    affinity[dst].push_back(src);
+                    affinity[src].push_back(dst);
+                }
+            };
+
+            size_t id = target->operand_find(control);
+            for (auto ref: target->value(0).references()) {
+                if (ref->opcode() == ir::Opcode::phi) relate(ref->value(0), ref->operand(id + 1));
+            }
+
+            if (_entry_state.empty()) continue;
+            auto& end_state = _end_state[block];
+            for (auto& [value, actual]: _entry_state[target]) {
+                auto src = end_state[value].actual;
+                if (actual != src) relate(actual, src);
+            }
+        }
+    }
+
+    // Upward exposed uses and definitions of slots in each block.
+    std::unordered_map<ir::Node*, std::unordered_set<ir::Value>> gen;
+    std::unordered_map<ir::Node*, std::unordered_set<ir::Value>> kill;
+    std::vector<ir::Value> order;
+    std::unordered_set<ir::Value> seen;
+    auto visit = [&](ir::Value value) {
+        if (seen.insert(value).second) order.push_back(value);
+    };
+    for (auto block: _block_analysis.blocks()) {
+        for (auto control: block->operands()) {
+            auto ptr = edge_defs.find(control);
+            if (ptr == edge_defs.end()) continue;
+            for (auto value: ptr->second) visit(value);
+        }
+
+        auto& block_gen = gen[block];
+        auto& block_kill = kill[block];
+        auto process = [&](ir::Node* node) {
+            for (auto use: slot_uses(node)) {
+                visit(use);
+                if (!block_kill.count(use)) block_gen.insert(use);
+            }
+            for (auto value: node->values()) {
+                if (!is_slot(value)) continue;
+                visit(value);
+                block_kill.insert(value);
+            }
+        };
+        for (auto node: _scheduler.get_node_list(block)) process(node);
+        process(static_cast<ir::Paired*>(block)->mate());
+    }
+
+    // Backward data-flow analysis as in compute_liveness.
+    std::unordered_map<ir::Node*, std::unordered_set<ir::Value>> live_in;
+    std::unordered_map<ir::Node*, std::unordered_set<ir::Value>> live_out;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto block: util::reverse_iterable(_block_analysis.blocks())) {
+            auto& out = live_out[block];
+            for (auto control: static_cast<ir::Paired*>(block)->mate()->values()) {
+                auto ptr = edge_defs.find(control);
+                if (ptr == edge_defs.end()) continue;
+                auto& defs = ptr->second;
+                for (auto value: live_in[ir::analysis::Block::get_target(control)]) {
+                    if (std::find(defs.begin(), defs.end(), value) == defs.end()) out.insert(value);
+                }
+                auto& uses = edge_uses[control];
+                out.insert(uses.begin(), uses.end());
+            }
+
+            auto& in = live_in[block];
+            auto& block_kill = kill[block];
+            size_t size = in.size();
+            in.insert(gen[block].begin(), gen[block].end());
+            for (auto value: out) {
+                if (!block_kill.count(value)) in.insert(value);
+            }
+            if (in.size() != size) changed = true;
+        }
+    }
+
+    // A slot written interferes with all slots live after the write. Slots live into a block and those written on
+    // edges into it are all occupied at the start of the block.
+    std::unordered_map<ir::Value, std::unordered_set<ir::Value>> interference;
+    auto interfere = [&](ir::Value a, ir::Value b) {
+        if (a == b) return;
+        interference[a].insert(b);
+        interference[b].insert(a);
+    };
+    for (auto block: _block_analysis.blocks()) {
+        auto live = live_out[block];
+        auto end = static_cast<ir::Paired*>(block)->mate();
+        for (auto use: slot_uses(end)) live.insert(use);
+
+        auto& nodelist = _scheduler.get_node_list(block);
+        for (auto node: util::reverse_iterable(nodelist)) {
+            for (auto value: node->values()) {
+                if (!is_slot(value)) continue;
+                for (auto other: live) interfere(value, other);
+                live.erase(value);
+            }
+            for (auto use: slot_uses(node)) live.insert(use);
+        }
+
+        for (auto control: block->operands()) {
+            auto ptr = edge_defs.find(control);
+            if (ptr == edge_defs.end()) continue;
+            live.insert(ptr->second.begin(), ptr->second.end());
+        }
+        for (auto a: live) {
+            for (auto b: live) interfere(a, b);
+        }
+    }
+
+    // Greedily color in order of first occurrence, preferring the slot of a related value so no move is needed.
+    std::unordered_map<ir::Value, size_t> color;
+    size_t slot_count = 0;
+    for (auto value: order) {
+        std::vector<bool> forbidden(slot_count);
+        for (auto other: interference[value]) {
+            auto ptr = color.find(other);
+            if (ptr != color.end()) forbidden[ptr->second] = true;
+        }
+
+        size_t slot = slot_count;
+        for (auto related: affinity[value]) {
+            auto ptr = color.find(related);
+            if (ptr != color.end() && !forbidden[ptr->second]) {
+                slot = ptr->second;
+                break;
+            }
+        }
+        if (slot == slot_count) slot = std::find(forbidden.begin(), forbidden.end(), false) - forbidden.begin();
+        if (slot == slot_count) slot_count++;
+        color[value] = slot;
+    }
+
+    for (auto& [value, slot]: color) {
+        Memory mem = _allocation[value].as_memory();
+        mem.displacement = slot * 8;
+        _allocation[value] = mem;
+    }
+    _stack_size = slot_count * 8;
+}
+
 Operand Register_allocator::get_allocation(ir::Value value) {
 #ifdef RELEASE
     return _allocation[value];
@@ -375,13 +956,16 @@ Operand Register_allocator::get_allocation(ir::Value value) {
 
 void Register_allocator::allocate() {
 
+    if (_global_regalloc) compute_liveness();
+
     // Generate code for the block.
     for (auto block: _block_analysis.blocks()) {
+        if (_global_regalloc) enter_block(block);
 
         // Bind all PHI nodes first (except memory-allocated once, which will be done by copy).
         int phi_id = 0;
         for (auto ref: block->value(0).references()) {
-            if (ref->opcode() == ir::Opcode::phi) {
+            if (!_global_regalloc && ref->opcode() == ir::Opcode::phi) {
                 auto value = ref->value(0);
 
                 // First try to fit into registers. The R11 is reserved for code generator to perform PHI reordering.
@@ -415,6 +999,8 @@ void Register_allocator::allocate() {
                 case ir::Opcode::ge:
                 case ir::Opcode::ltu:
                 case ir::Opcode::geu:
+                case Target_opcode::test_zero:
+                case Target_opcode::test_nonzero:
                 case Target_opcode::address:
                     _nodelist->erase(_nodelist->begin() + _node_index);
                     _node_index--;
@@ -437,7 +1023,12 @@ void Register_allocator::allocate() {
                     bind_register(output, reg);
                     break;
                 }
-                case ir::Opcode::store_memory: {
+                case ir::Opcode::store_memory:
+                case Target_opcode::add_memory:
+                case Target_opcode::sub_memory:
+                case Target_opcode::xor_memory:
+                case Target_opcode::or_memory:
+                case Target_opcode::and_memory: {
                     auto value = get_actual_value_and_deref(node, 2, false, true);
                     pin_value(value);
                     emit_address(node->operand(1));
@@ -446,6 +1037,7 @@ void Register_allocator::allocate() {
                 }
                 case Target_opcode::lea: {
                     auto output = node->value(0);
+                    _remat_address.emplace(output, ir::Node::Operand_container(node->operand(0).node()->operands()));
                     emit_address(node->operand(0));
 
                     Register reg = alloc_register(output.type());
@@ -474,6 +1066,17 @@ void Register_allocator::allocate() {
                     }
                     break;
                 }
+                case ir::Opcode::push_return: {
+                    // Code generator uses rax and rdx as scratch registers to access the shadow return stack. The stack
+                    // pointer is read before anything is clobbered, so it is fine for it to live in rax or rdx.
+                    get_actual_value_and_deref(node, 1, true, true);
+                    if (_register_content[0]) spill_register(Register::rax);
+                    if (_register_content[2]) spill_register(Register::rdx);
+                    break;
+                }
+                case ir::Opcode::add_instret:
+                    // The count is a constant and is encoded as an immediate.
+                    break;
                 case ir::Opcode::cast: {
                     auto output = node->value(0);
                     auto op = node->operand(0);
@@ -684,6 +1287,11 @@ void Register_allocator::allocate() {
             }
         }
 
+        if (_global_regalloc) {
+            leave_block(block);
+            continue;
+        }
+
         // For anything cross basic block, life time management is harder. We cannot recycle its memory when we
         // encounter the last use for example, as it may still be used later. We workaround this by spilling everything
         // into memory, adding 1 to each variable live at the end of basic block to make it live across entire region.
@@ -693,6 +1301,9 @@ void Register_allocator::allocate() {
         }
     }
 
+    color_stack_slots();
+    if (_global_regalloc) compute_edge_moves();
+
     // Finally align the stack to 16 bytes
     _stack_size = (_stack_size + 15) &~ 15;
 }